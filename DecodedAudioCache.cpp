@@ -0,0 +1,155 @@
+//
+//  DecodedAudioCache.cpp
+//  console_renderer - ConsoleApp
+//
+//  Process-wide cache of decoded input files.
+//
+
+#include "DecodedAudioCache.hpp"
+
+
+using namespace juce;
+
+MusicIO::DecodedAudioCache& MusicIO::DecodedAudioCache::getInstance()
+{
+    static DecodedAudioCache cache;
+    return cache;
+}
+
+
+MusicIO::DecodedAudioCache::Buffer MusicIO::DecodedAudioCache::get(
+    String pathToAudioInFile,
+    AudioFileInfo& fileInfo,
+    bool isMono)
+{
+    const String key = pathToAudioInFile + (isMono ? "|mono" : "|stereo");
+    const Time modificationTime = File (pathToAudioInFile).getLastModificationTime();
+
+    std::unique_lock<std::mutex> guard (lock);
+
+    for (;;)
+    {
+        auto it = entries.find (key);
+        if (it == entries.end())
+            break;
+
+        auto& entry = it->second;
+        if (entry.isLoading)
+        {
+            // another job is decoding this file
+            loaded.wait (guard);
+            continue;
+        }
+
+        if (entry.modificationTime != modificationTime)
+        {
+            // stale, the file changed on disk
+            memoryUsage -= entry.bytes;
+            entries.erase (it);
+            break;
+        }
+
+        entry.lastUsed = ++useCounter;
+        fileInfo = entry.fileInfo;
+        Buffer buffer = entry.buffer;
+
+        // entries released since the last call may be evictable now
+        evict (key);
+        return buffer;
+    }
+
+    entries[key].modificationTime = modificationTime;
+    guard.unlock();
+
+    // decode outside the lock
+    auto decoded = std::make_shared<AudioBuffer<float>>();
+    auto decodedInfo = readWavFile (pathToAudioInFile, *decoded, isMono);
+
+    guard.lock();
+    auto& entry = entries[key];
+
+    if (decoded->getNumSamples() == 0)
+    {
+        // do not cache failures
+        entries.erase (key);
+        loaded.notify_all();
+        fileInfo = decodedInfo;
+        return nullptr;
+    }
+
+    entry.buffer = decoded;
+    entry.fileInfo = decodedInfo;
+    entry.bytes = sizeof (float) * (size_t) decoded->getNumChannels() * (size_t) decoded->getNumSamples();
+    entry.lastUsed = ++useCounter;
+    entry.isLoading = false;
+    memoryUsage += entry.bytes;
+
+    evict (key);
+    loaded.notify_all();
+
+    fileInfo = decodedInfo;
+    return decoded;
+}
+
+
+void MusicIO::DecodedAudioCache::evict(const String& keep)
+{
+    // Least recently used first. Buffers a job still holds are never evicted:
+    // a later get() would decode a second copy while the first is alive. They
+    // keep counting against the budget and become evictable once released.
+    while (memoryUsage > memoryBudget)
+    {
+        auto oldest = entries.end();
+        for (auto it = entries.begin(); it != entries.end(); ++it)
+        {
+            if (it->second.isLoading || it->first == keep || it->second.buffer.use_count() > 1)
+                continue;
+            if (oldest == entries.end() || it->second.lastUsed < oldest->second.lastUsed)
+                oldest = it;
+        }
+
+        if (oldest == entries.end())
+            break;
+
+        memoryUsage -= oldest->second.bytes;
+        entries.erase (oldest);
+    }
+}
+
+
+void MusicIO::DecodedAudioCache::setMemoryBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> guard (lock);
+    memoryBudget = bytes;
+    evict ({});
+}
+
+
+size_t MusicIO::DecodedAudioCache::getMemoryBudget() const
+{
+    std::lock_guard<std::mutex> guard (lock);
+    return memoryBudget;
+}
+
+
+size_t MusicIO::DecodedAudioCache::getMemoryUsage() const
+{
+    std::lock_guard<std::mutex> guard (lock);
+    return memoryUsage;
+}
+
+
+void MusicIO::DecodedAudioCache::clear()
+{
+    std::lock_guard<std::mutex> guard (lock);
+    for (auto it = entries.begin(); it != entries.end();)
+    {
+        if (it->second.isLoading)
+        {
+            ++it;
+            continue;
+        }
+        memoryUsage -= it->second.bytes;
+        it = entries.erase (it);
+    }
+}
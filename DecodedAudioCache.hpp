@@ -0,0 +1,73 @@
+//
+//  DecodedAudioCache.hpp
+//  console_renderer - ConsoleApp
+//
+//  Process-wide cache of decoded input files.
+//
+
+#ifndef DecodedAudioCache_hpp
+#define DecodedAudioCache_hpp
+
+#include <JuceHeader.h>
+#include "MusicIO.hpp"
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+
+using namespace juce;
+
+
+namespace MusicIO {
+
+/*
+ Jobs rendering the same source share one decoded, read-only buffer. The first
+ caller decodes the file, concurrent callers for the same file wait for that
+ decode instead of starting their own. Entries are reference counted: when the
+ cache goes over its memory budget the least recently used entries that no job
+ holds any more are dropped. Buffers still in use are kept, and counted against
+ the budget, until they are released.
+ */
+
+class DecodedAudioCache
+{
+public:
+    using Buffer = std::shared_ptr<const AudioBuffer<float>>;
+
+    static DecodedAudioCache& getInstance();
+
+    // Returns nullptr if the file cannot be read.
+    Buffer get(
+            String pathToAudioInFile,
+            AudioFileInfo& fileInfo,
+            bool isMono=false);
+
+    void setMemoryBudget(size_t bytes);
+    size_t getMemoryBudget() const;
+    size_t getMemoryUsage() const;
+    void clear();
+
+private:
+    struct Entry{
+        Buffer buffer;
+        AudioFileInfo fileInfo;
+        Time modificationTime;
+        size_t bytes = 0;
+        uint64 lastUsed = 0;
+        bool isLoading = true;
+    };
+
+    void evict(const String& keep);
+
+    mutable std::mutex lock;
+    std::condition_variable loaded;
+    std::map<String, Entry> entries;
+    size_t memoryBudget = (size_t) 512 * 1024 * 1024;
+    size_t memoryUsage = 0;
+    uint64 useCounter = 0;
+};
+
+} // namespace MusicIO
+
+
+#endif /* DecodedAudioCache_hpp */
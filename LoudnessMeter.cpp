@@ -0,0 +1,398 @@
+//
+//  LoudnessMeter.cpp
+//  console_renderer - ConsoleApp
+//
+//  Loudness and peak analysis of rendered audio.
+//
+
+#include "LoudnessMeter.hpp"
+#include "RenderMetrics.hpp"
+
+
+using namespace juce;
+
+namespace
+{
+    const double minusInfinity = -std::numeric_limits<double>::infinity();
+
+    double energyToDecibels (double energy)
+    {
+        return energy > 0.0 ? 10.0 * std::log10 (energy) : minusInfinity;
+    }
+
+    double gainToDecibels (double gain)
+    {
+        return gain > 0.0 ? 20.0 * std::log10 (gain) : minusInfinity;
+    }
+
+    double energyToLoudness (double energy)
+    {
+        return -0.691 + energyToDecibels (energy);
+    }
+
+    double loudnessToEnergy (double loudness)
+    {
+        return std::pow (10.0, (loudness + 0.691) / 10.0);
+    }
+}
+
+//==============================================================================
+
+MusicIO::LoudnessMeter::LoudnessMeter(int rate, int numChannels)
+    : sampleRate (rate),
+      stepLength (jmax (1, rate / 10)),
+      channels ((size_t) numChannels)
+{
+    // K-weighting, BS.1770 pre-filter (high shelf) and RLB high pass for any rate
+    {
+        const double f0 = 1681.974450955533;
+        const double gainDb = 3.999843853973347;
+        const double q = 0.7071752369554196;
+
+        const double k = std::tan (MathConstants<double>::pi * f0 / sampleRate);
+        const double vh = std::pow (10.0, gainDb / 20.0);
+        const double vb = std::pow (vh, 0.4996667741545416);
+        const double a0 = 1.0 + k / q + k * k;
+
+        shelf.b0 = (vh + vb * k / q + k * k) / a0;
+        shelf.b1 = 2.0 * (k * k - vh) / a0;
+        shelf.b2 = (vh - vb * k / q + k * k) / a0;
+        shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+        shelf.a2 = (1.0 - k / q + k * k) / a0;
+    }
+    {
+        const double f0 = 38.13547087602444;
+        const double q = 0.5003270373238773;
+
+        const double k = std::tan (MathConstants<double>::pi * f0 / sampleRate);
+        const double a0 = 1.0 + k / q + k * k;
+
+        highPass.b0 = 1.0;
+        highPass.b1 = -2.0;
+        highPass.b2 = 1.0;
+        highPass.a1 = 2.0 * (k * k - 1.0) / a0;
+        highPass.a2 = (1.0 - k / q + k * k) / a0;
+    }
+
+    // 4x interpolator: Hann-windowed sinc, split into phases with unity DC gain
+    const int numTaps = oversampling * tapsPerPhase;
+    for (int p = 0; p < oversampling; ++p)
+    {
+        double sum = 0.0;
+        double taps[tapsPerPhase];
+
+        for (int k = 0; k < tapsPerPhase; ++k)
+        {
+            const int n = k * oversampling + p;
+            const double t = (n - (numTaps - 1) * 0.5) / oversampling;
+            const double sinc = t == 0.0 ? 1.0 : std::sin (MathConstants<double>::pi * t) / (MathConstants<double>::pi * t);
+            const double window = 0.5 - 0.5 * std::cos (MathConstants<double>::twoPi * (n + 1) / (numTaps + 1));
+            taps[k] = sinc * window;
+            sum += taps[k];
+        }
+
+        for (int k = 0; k < tapsPerPhase; ++k)
+            phases[p][k] = (float) (taps[k] / sum);
+    }
+
+    // channel weights of BS.1770 for 5.1: L R C LFE Ls Rs
+    if (numChannels == 6)
+    {
+        const double weights[6] = { 1.0, 1.0, 1.0, 0.0, 1.41, 1.41 };
+        for (int c = 0; c < 6; ++c)
+            channels[(size_t) c].weight = weights[c];
+    }
+
+    blockEnergies.reserve (3600 * 10);
+}
+
+
+void MusicIO::LoudnessMeter::reset()
+{
+    for (auto& channel : channels)
+    {
+        const double weight = channel.weight;
+        channel = ChannelState();
+        channel.weight = weight;
+    }
+
+    stepPosition = 0;
+    numSamplesProcessed = 0;
+    numSteps = 0;
+    blockEnergies.clear();
+}
+
+
+void MusicIO::LoudnessMeter::process(const AudioBuffer<float>& buffer, int startSample, int numSamples)
+{
+    const int numChannels = jmin (buffer.getNumChannels(), (int) channels.size());
+
+    // split at the 100 ms gating steps
+    int done = 0;
+    while (done < numSamples)
+    {
+        const int n = jmin (numSamples - done, stepLength - stepPosition);
+
+        int c = 0;
+        for (; c + 1 < numChannels; c += 2)
+        {
+            ChannelState* const states[2] = { &channels[(size_t) c], &channels[(size_t) c + 1] };
+            const float* const samples[2] = { buffer.getReadPointer (c, startSample + done),
+                                              buffer.getReadPointer (c + 1, startSample + done) };
+            filterChannels<2> (states, samples, n);
+        }
+        if (c < numChannels)
+        {
+            ChannelState* const states[1] = { &channels[(size_t) c] };
+            const float* const samples[1] = { buffer.getReadPointer (c, startSample + done) };
+            filterChannels<1> (states, samples, n);
+        }
+
+        done += n;
+        stepPosition += n;
+        if (stepPosition == stepLength)
+        {
+            finishStep();
+            stepPosition = 0;
+        }
+    }
+
+    for (int c = 0; c < numChannels; ++c)
+    {
+        auto range = FloatVectorOperations::findMinAndMax (buffer.getReadPointer (c, startSample), numSamples);
+        auto& channel = channels[(size_t) c];
+        channel.samplePeak = jmax (channel.samplePeak, std::abs (range.getStart()), std::abs (range.getEnd()));
+        measureTruePeak (channel, buffer.getReadPointer (c, startSample), numSamples);
+    }
+
+    numSamplesProcessed += numSamples;
+}
+
+
+template <int numLanes>
+void MusicIO::LoudnessMeter::filterChannels(ChannelState* const* states, const float* const* samples, int numSamples)
+{
+    // K-weighting, two biquads in transposed direct form II. Every lane is
+    // independent, so each statement below is one 2-wide operation for a pair.
+    double z10[numLanes], z11[numLanes], z20[numLanes], z21[numLanes];
+    double energy[numLanes], sumSquares[numLanes];
+
+    for (int l = 0; l < numLanes; ++l)
+    {
+        z10[l] = states[l]->z[0][0];
+        z11[l] = states[l]->z[0][1];
+        z20[l] = states[l]->z[1][0];
+        z21[l] = states[l]->z[1][1];
+        energy[l] = 0.0;
+        sumSquares[l] = 0.0;
+    }
+
+    for (int i = 0; i < numSamples; ++i)
+    {
+        double x[numLanes], y1[numLanes], y2[numLanes];
+
+        for (int l = 0; l < numLanes; ++l)
+            x[l] = samples[l][i];
+
+        for (int l = 0; l < numLanes; ++l)
+        {
+            sumSquares[l] += x[l] * x[l];
+
+            y1[l] = shelf.b0 * x[l] + z10[l];
+            z10[l] = shelf.b1 * x[l] - shelf.a1 * y1[l] + z11[l];
+            z11[l] = shelf.b2 * x[l] - shelf.a2 * y1[l];
+
+            y2[l] = highPass.b0 * y1[l] + z20[l];
+            z20[l] = highPass.b1 * y1[l] - highPass.a1 * y2[l] + z21[l];
+            z21[l] = highPass.b2 * y1[l] - highPass.a2 * y2[l];
+
+            energy[l] += y2[l] * y2[l];
+        }
+    }
+
+    for (int l = 0; l < numLanes; ++l)
+    {
+        states[l]->z[0][0] = z10[l];
+        states[l]->z[0][1] = z11[l];
+        states[l]->z[1][0] = z20[l];
+        states[l]->z[1][1] = z21[l];
+        states[l]->gatingEnergy += energy[l];
+        states[l]->sumSquares += sumSquares[l];
+    }
+}
+
+
+void MusicIO::LoudnessMeter::measureTruePeak(ChannelState& state, const float* samples, int numSamples)
+{
+    // Each phase is a 12-tap FIR over a chunk: one multiply-add per tap, each
+    // running across the whole chunk, then a vectorised min/max of the result.
+    const int numHistory = tapsPerPhase - 1;
+    float truePeak = state.truePeak;
+
+    FloatVectorOperations::copy (interpolationInput, state.history, numHistory);
+
+    for (int done = 0; done < numSamples;)
+    {
+        const int n = jmin (numSamples - done, truePeakChunk);
+        FloatVectorOperations::copy (interpolationInput + numHistory, samples + done, n);
+
+        for (int p = 0; p < oversampling; ++p)
+        {
+            FloatVectorOperations::clear (interpolationOutput, n);
+            for (int k = 0; k < tapsPerPhase; ++k)
+                FloatVectorOperations::addWithMultiply (interpolationOutput, interpolationInput + numHistory - k, phases[p][k], n);
+
+            auto range = FloatVectorOperations::findMinAndMax (interpolationOutput, n);
+            truePeak = jmax (truePeak, std::abs (range.getStart()), std::abs (range.getEnd()));
+        }
+
+        // keep the last samples in front of the next chunk
+        std::memmove (interpolationInput, interpolationInput + n, sizeof (float) * (size_t) numHistory);
+        done += n;
+    }
+
+    FloatVectorOperations::copy (state.history, interpolationInput, numHistory);
+    state.truePeak = truePeak;
+}
+
+
+void MusicIO::LoudnessMeter::finishStep()
+{
+    double energy = 0.0;
+    for (auto& channel : channels)
+    {
+        energy += channel.weight * channel.gatingEnergy / stepLength;
+        channel.gatingEnergy = 0.0;
+    }
+
+    stepEnergies[numSteps % 4] = energy;
+    ++numSteps;
+
+    if (numSteps >= 4)
+        blockEnergies.push_back (0.25 * (stepEnergies[0] + stepEnergies[1] + stepEnergies[2] + stepEnergies[3]));
+}
+
+
+MusicIO::LoudnessInfo MusicIO::LoudnessMeter::getInfo() const
+{
+    LoudnessInfo info;
+
+    // absolute gate, then relative gate 10 LU below the absolute-gated loudness
+    const double absoluteGate = loudnessToEnergy (-70.0);
+    double sum = 0.0;
+    int count = 0;
+    for (auto energy : blockEnergies)
+    {
+        if (energy > absoluteGate)
+        {
+            sum += energy;
+            ++count;
+        }
+    }
+
+    info.integratedLoudness = minusInfinity;
+    if (count > 0)
+    {
+        const double relativeGate = jmax (absoluteGate, loudnessToEnergy (energyToLoudness (sum / count) - 10.0));
+        sum = 0.0;
+        count = 0;
+        for (auto energy : blockEnergies)
+        {
+            if (energy > relativeGate)
+            {
+                sum += energy;
+                ++count;
+            }
+        }
+
+        if (count > 0)
+            info.integratedLoudness = energyToLoudness (sum / count);
+    }
+
+    float samplePeak = 0.0f;
+    float truePeak = 0.0f;
+    for (auto& channel : channels)
+    {
+        samplePeak = jmax (samplePeak, channel.samplePeak);
+        truePeak = jmax (truePeak, channel.truePeak, channel.samplePeak);
+
+        info.rms.add (numSamplesProcessed > 0 ? energyToDecibels (channel.sumSquares / (double) numSamplesProcessed)
+                                              : minusInfinity);
+    }
+
+    info.samplePeak = gainToDecibels (samplePeak);
+    info.truePeak = gainToDecibels (truePeak);
+    return info;
+}
+
+//==============================================================================
+// Normalisation
+
+bool MusicIO::normaliseWavFile(
+    String pathToAudioFile,
+    const LoudnessInfo& loudnessInfo,
+    double& appliedGain,
+    double targetLoudness,
+    double truePeakCeiling)
+{
+    appliedGain = 0.0;
+
+    if (! std::isfinite (loudnessInfo.integratedLoudness))
+        return false;
+
+    double gainDb = targetLoudness - loudnessInfo.integratedLoudness;
+    if (std::isfinite (loudnessInfo.truePeak))
+        gainDb = jmin (gainDb, truePeakCeiling - loudnessInfo.truePeak);
+
+    File file(pathToAudioFile);
+    AudioFormatManager formatManager;
+    formatManager.registerBasicFormats();
+    std::unique_ptr<AudioFormatReader> reader (formatManager.createReaderFor (file));
+
+    if (reader == nullptr)
+        return false;
+
+    // streamed in chunks into a temporary file that then replaces the original
+    TemporaryFile temp(file);
+    WavAudioFormat format;
+    std::unique_ptr<AudioFormatWriter> writer;
+
+    writer.reset(
+        format.createWriterFor(new FileOutputStream(temp.getFile()),
+        reader->sampleRate,
+        reader->numChannels,
+        (int) reader->bitsPerSample,
+        {},
+        0));
+
+    if (writer == nullptr)
+        return false;
+
+    const float gain = (float) std::pow (10.0, gainDb / 20.0);
+    AudioBuffer<float> chunk((int) reader->numChannels, 65536);
+
+    for (int64 position = 0; position < reader->lengthInSamples; position += chunk.getNumSamples())
+    {
+        const int n = (int) jmin ((int64) chunk.getNumSamples(), reader->lengthInSamples - position);
+        reader->read (&chunk, 0, n, position, true, true);
+        chunk.applyGain (0, n, gain);
+        writer->writeFromAudioSampleBuffer (chunk, 0, n);
+    }
+
+    writer.reset();
+    reader.reset();
+
+    // the whole file has been read back, whether or not the rewrite succeeds
+    auto& metrics = RenderMetrics::getInstance();
+    metrics.filesRead += 1;
+    metrics.bytesRead += file.getSize();
+
+    if (! temp.overwriteTargetFileWithTemporary())
+        return false;
+
+    metrics.filesWritten += 1;
+    metrics.bytesWritten += file.getSize();
+
+    appliedGain = gainDb;
+    return true;
+}
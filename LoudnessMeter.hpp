@@ -0,0 +1,98 @@
+//
+//  LoudnessMeter.hpp
+//  console_renderer - ConsoleApp
+//
+//  Loudness and peak analysis of rendered audio.
+//
+
+#ifndef LoudnessMeter_hpp
+#define LoudnessMeter_hpp
+
+#include <JuceHeader.h>
+#include "MusicIO.hpp"
+
+#include <vector>
+
+using namespace juce;
+
+
+namespace MusicIO {
+
+/*
+ Incremental ITU-R BS.1770-4 meter, fed block by block from the render loop so
+ the output never has to be read back. Integrated loudness uses K-weighting and
+ 400 ms gating blocks with 75% overlap (absolute gate at -70 LUFS, relative gate
+ at -10 LU). True peak is measured on a 4x polyphase interpolation.
+
+ The K-weighting filters run two channels at a time (L/R, C/LFE, Ls/Rs) with
+ the state of each pair in independent lanes, so the compiler can keep a pair in
+ one 2-wide double register. The interpolator is a block FIR built from
+ FloatVectorOperations, vectorised across samples rather than across taps.
+ */
+
+class LoudnessMeter
+{
+public:
+    LoudnessMeter(int sampleRate, int numChannels);
+
+    void reset();
+    void process(const AudioBuffer<float>& buffer, int startSample, int numSamples);
+    LoudnessInfo getInfo() const;
+
+    static constexpr int oversampling = 4;
+    static constexpr int tapsPerPhase = 12;
+    static constexpr int truePeakChunk = 256;
+
+private:
+    struct Biquad{
+        double b0, b1, b2, a1, a2;
+    };
+
+    struct ChannelState{
+        double weight = 1.0;
+        double z[2][2] = {};                    // direct form II transposed, per stage
+        double gatingEnergy = 0.0;              // of the current 100 ms step
+        double sumSquares = 0.0;
+        float samplePeak = 0.0f;
+        float truePeak = 0.0f;
+        float history[tapsPerPhase - 1] = {};   // last input samples, oldest first
+    };
+
+    template <int numLanes>
+    void filterChannels(ChannelState* const* states, const float* const* samples, int numSamples);
+    void measureTruePeak(ChannelState& state, const float* samples, int numSamples);
+    void finishStep();
+
+    int sampleRate;
+    int stepLength;                 // 100 ms
+    int stepPosition = 0;
+    int64 numSamplesProcessed = 0;
+
+    Biquad shelf, highPass;
+    float phases[oversampling][tapsPerPhase];   // phases[p][k] weights the input k samples back
+    std::vector<ChannelState> channels;
+
+    float interpolationInput[tapsPerPhase - 1 + truePeakChunk];
+    float interpolationOutput[truePeakChunk];
+
+    double stepEnergies[4] = {};    // last four steps make one 400 ms gating block
+    int numSteps = 0;
+    std::vector<double> blockEnergies;
+};
+
+
+// Second pass over a written file: scales it to targetLoudness (LUFS) without
+// pushing the true peak above truePeakCeiling (dBTP). Returns false, leaving
+// the file untouched, if it is silent or cannot be read or rewritten;
+// appliedGain receives the gain in dB, 0 on failure.
+bool normaliseWavFile(
+        String pathToAudioFile,
+        const LoudnessInfo& loudnessInfo,
+        double& appliedGain,
+        double targetLoudness=-23.0,
+        double truePeakCeiling=-1.0);
+
+} // namespace MusicIO
+
+
+#endif /* LoudnessMeter_hpp */
@@ -6,68 +6,108 @@
 
 #include <JuceHeader.h>
 #include "MusicIO.hpp"
+#include "PluginSandbox.hpp"
+#include "DecodedAudioCache.hpp"
+#include "RenderMetrics.hpp"
+#include "LoudnessMeter.hpp"
+#include "MidiStems.hpp"
 #include "yaml-cpp/yaml.h"
 
 using namespace juce;
 
 
+// CPU time of the last processBlock spent in a worker process. The parent of a
+// sandboxed plugin mostly sleeps in sem_wait, so its own thread time misses it.
+static int64 getRemoteCpuNanoseconds(AudioProcessor&)                          { return 0; }
+static int64 getRemoteCpuNanoseconds(MusicIO::SandboxedProcessor& processor)   { return processor.getLastBlockCpuNanoseconds(); }
+
+// Blocks rendered as silence and worker restarts of a sandboxed plugin, so a
+// crash mid-render shows up in the job metrics instead of only in the output.
+static int getNumDroppedBlocks(AudioProcessor&)                                 { return 0; }
+static int getNumDroppedBlocks(MusicIO::SandboxedProcessor& processor)          { return processor.getNumDroppedBlocks(); }
+static int getNumRestarts(AudioProcessor&)                                      { return 0; }
+static int getNumRestarts(MusicIO::SandboxedProcessor& processor)               { return processor.getNumRestarts(); }
+
+
 /*
  The channels of audioFxInstance should be strictly larger than audio samples.
+ The last block may be shorter than bufferSize, so the input is never padded.
+ When metrics is given, progress and processBlock CPU time are counted per block.
+ When meter is given, each rendered block is fed to it as it is written out.
  */
 
 template<class T>
 void renderAudio(
-        AudioBuffer<float>& inBuffer,
+        const AudioBuffer<float>& inBuffer,
         AudioBuffer<float>& outBuffer,
         int bufferSize,
         int tailSeconds,
         int sampleRate,
-        std::unique_ptr<T> &audioFxInstance)
+        std::unique_ptr<T> &audioFxInstance,
+        MusicIO::JobMetrics* metrics=nullptr,
+        MusicIO::LoudnessMeter* meter=nullptr)
 {
     int sampleLength = inBuffer.getNumSamples();
-    int numberOfBuffers = int (
-        std::ceil ((sampleLength + sampleRate * tailSeconds) / bufferSize));
+    int numberOfSamples = sampleLength + sampleRate * tailSeconds;
+    int numberOfBuffers = (numberOfSamples + bufferSize - 1) / bufferSize;
 
-    int numberOfSamples = numberOfBuffers * bufferSize;
     int numRenderChannels = audioFxInstance->getTotalNumOutputChannels();
     int numAudioChannels = inBuffer.getNumChannels();
-    
-    std::cout << " [render audio]    plugin channels: " << numRenderChannels << std::endl;
-    std::cout << " [render audio]     audio channels: " << numAudioChannels << std::endl;
-    std::cout << " [render audio]  number of buffers: " << numberOfBuffers << std::endl;
-    std::cout << " [render audio]  number of samples: " << numberOfSamples << std::endl;
-   
-    // initialize padded input buffer
-    AudioBuffer<float> inputBuffer(numAudioChannels, numberOfSamples);
-    for (int c = 0; c < numAudioChannels; ++c)
-    {
-        inputBuffer.copyFrom(c, 0, inBuffer, c, 0, inBuffer.getNumSamples());
-    }
+
+    if (metrics != nullptr)
+        metrics->start(numberOfSamples);
 
     // initialize output buffer
-    outBuffer.setSize(inBuffer.getNumChannels(), numberOfSamples);
+    outBuffer.setSize(numAudioChannels, numberOfSamples);
     
     // run
     MidiBuffer midi;
+    AudioBuffer<float> procBuffer(numRenderChannels, bufferSize);
     for (int b = 0; b < numberOfBuffers; ++b) {
 
-        // copy into processing buffer
-        AudioBuffer<float> procBuffer(numRenderChannels, bufferSize);
-        for (int c = 0; c < numAudioChannels; ++c)
+        int start = b * bufferSize;
+        int blockLength = jmin (bufferSize, numberOfSamples - start);
+        int inputLength = jlimit (0, blockLength, sampleLength - start);
+
+        // view on the first blockLength samples of the processing buffer
+        AudioBuffer<float> block(procBuffer.getArrayOfWritePointers(), numRenderChannels, blockLength);
+        block.clear();
+
+        // copy into processing buffer, the tail is left silent
+        if (inputLength > 0)
         {
-            procBuffer.copyFrom(c, 0, inputBuffer, c, b * bufferSize, bufferSize);
+            for (int c = 0; c < numAudioChannels; ++c)
+            {
+                block.copyFrom(c, 0, inBuffer, c, start, inputLength);
+            }
         }
 
         // process
-        audioFxInstance->processBlock (procBuffer, midi);
+        midi.clear();
+        int droppedStart = getNumDroppedBlocks(*audioFxInstance);
+        int restartsStart = getNumRestarts(*audioFxInstance);
+        int64 cpuStart = metrics != nullptr ? MusicIO::RenderMetrics::getThreadCpuNanoseconds() : 0;
+        audioFxInstance->processBlock (block, midi);
+
+        if (metrics != nullptr)
+            metrics->addBlock(blockLength, MusicIO::RenderMetrics::getThreadCpuNanoseconds() - cpuStart
+                                           + getRemoteCpuNanoseconds(*audioFxInstance),
+                                           getNumDroppedBlocks(*audioFxInstance) - droppedStart,
+                                           getNumRestarts(*audioFxInstance) - restartsStart);
 
 
         // copy out
         for (int c = 0; c < numAudioChannels; ++c)
         {
-            outBuffer.copyFrom(c, b * bufferSize, procBuffer, c, 0, bufferSize);
+            outBuffer.copyFrom(c, start, block, c, 0, blockLength);
         }
+
+        if (meter != nullptr)
+            meter->process(outBuffer, start, blockLength);
     }
+
+    if (metrics != nullptr)
+        metrics->finish();
 }
 
 
@@ -78,53 +118,266 @@ void renderMidi(
         int bufferSize,
         int tailSeconds,
         int sampleRate,
-        std::unique_ptr<T> &instrument)
+        std::unique_ptr<T> &instrument,
+        MusicIO::JobMetrics* metrics=nullptr,
+        MusicIO::LoudnessMeter* meter=nullptr)
 {
     
-    int numberOfBuffers = int (
-            std::ceil ((midiBuffer.getLastEventTime() + sampleRate * tailSeconds) / bufferSize));
-    
-    
-    int numberOfSamples = numberOfBuffers * bufferSize;
-    std::cout << " [render midi] number of buffers :" << numberOfBuffers << std::endl;
-    std::cout << " [render midi] number of samples :" << numberOfSamples << std::endl;
+    int numberOfSamples = midiBuffer.getLastEventTime() + 1 + sampleRate * tailSeconds;
+    int numberOfBuffers = (numberOfSamples + bufferSize - 1) / bufferSize;
     outBuffer.setSize(2, numberOfSamples);
+
+    if (metrics != nullptr)
+        metrics->start(numberOfSamples);
     
     // initialize render info
     MidiBuffer renderMidiBuffer;
-    MidiBuffer::Iterator it(midiBuffer);
-    MidiMessage m;
-    int sampleNumber = -1;
-    bool isMessageBetween;
-    bool bufferRemaining = it.getNextEvent(m, sampleNumber);
     AudioBuffer<float> audioBuffer(instrument->getTotalNumOutputChannels(), bufferSize);
     
     // run
     for (int i = 0; i < numberOfBuffers; ++i)
     {
 
-        double start = i * bufferSize;
-        double end = (i + 1) * bufferSize;
+        int start = i * bufferSize;
+        int blockLength = jmin (bufferSize, numberOfSamples - start);
 
-        isMessageBetween = sampleNumber >= start && sampleNumber < end;
-        do {
-            if (isMessageBetween) {
-                renderMidiBuffer.addEvent(m, sampleNumber - start);
-                bufferRemaining = it.getNextEvent(m, sampleNumber);
-                isMessageBetween = sampleNumber >= start && sampleNumber < end;
-            }
-        } while (isMessageBetween && bufferRemaining);
+        // events of this block, shifted to block-relative sample positions
+        renderMidiBuffer.clear();
+        renderMidiBuffer.addEvents(midiBuffer, start, blockLength, -start);
 
         // Turn Midi to audio via the vst.
-        instrument->processBlock (audioBuffer, renderMidiBuffer);
+        AudioBuffer<float> block(audioBuffer.getArrayOfWritePointers(), audioBuffer.getNumChannels(), blockLength);
+        block.clear();
+        int droppedStart = getNumDroppedBlocks(*instrument);
+        int restartsStart = getNumRestarts(*instrument);
+        int64 cpuStart = metrics != nullptr ? MusicIO::RenderMetrics::getThreadCpuNanoseconds() : 0;
+        instrument->processBlock (block, renderMidiBuffer);
+
+        if (metrics != nullptr)
+            metrics->addBlock(blockLength, MusicIO::RenderMetrics::getThreadCpuNanoseconds() - cpuStart
+                                           + getRemoteCpuNanoseconds(*instrument),
+                                           getNumDroppedBlocks(*instrument) - droppedStart,
+                                           getNumRestarts(*instrument) - restartsStart);
 
         // copy out
         for (int c = 0; c < 2; ++c)
         {
-            outBuffer.copyFrom(c, i * bufferSize, audioBuffer, c, 0, bufferSize);
+            outBuffer.copyFrom(c, start, block, c, 0, blockLength);
+        }
+
+        if (meter != nullptr)
+            meter->process(outBuffer, start, blockLength);
+
+    }
+
+    if (metrics != nullptr)
+        metrics->finish();
+}
+
+
+/*
+ Stem render: stems[i] drives its own instrument instance instruments[i], e.g.
+ from an InstrumentPool. Each stem is rendered block by block with renderMidi,
+ all stems in parallel on a thread pool. The stems are padded to a common
+ length; when mixBuffer is given it receives their sum. stemMetrics[i] and
+ stemMeters[i] (either may be left out or hold nullptr) are passed on to the
+ render of stem i; stemMeters[i] also meters the padding, so it covers the
+ stem as written. mixMeter measures the mix. Returns false, rendering nothing,
+ if there are fewer instruments than stems.
+ */
+
+template<class T>
+bool renderMidiStems(
+        Array<MusicIO::MidiStem>& stems,
+        std::vector<std::unique_ptr<T>>& instruments,
+        OwnedArray<AudioBuffer<float>>& outBuffers,
+        AudioBuffer<float>* mixBuffer,
+        int bufferSize,
+        int tailSeconds,
+        int sampleRate,
+        const Array<MusicIO::JobMetrics*>& stemMetrics={},
+        const Array<MusicIO::LoudnessMeter*>& stemMeters={},
+        MusicIO::LoudnessMeter* mixMeter=nullptr,
+        int numThreads=SystemStats::getNumCpus())
+{
+    outBuffers.clear();
+    
+    // one instance per stem, they render concurrently
+    if (instruments.size() < (size_t) stems.size())
+    {
+        std::cout << " [stems] " << stems.size() << " stems but only " << instruments.size() << " instruments" << std::endl;
+        return false;
+    }
+    
+    for (int s = 0; s < stems.size(); ++s)
+        outBuffers.add(new AudioBuffer<float>());
+    
+    // run, one job per stem
+    ThreadPool pool(jmax (1, jmin (numThreads, stems.size())));
+    WaitableEvent allDone;
+    std::atomic<int> remaining { stems.size() };
+    
+    for (int s = 0; s < stems.size(); ++s)
+    {
+        pool.addJob([&, s]
+        {
+            renderMidi(
+                stems.getReference(s).midiBuffer,
+                *outBuffers[s],
+                bufferSize,
+                tailSeconds,
+                sampleRate,
+                instruments[(size_t) s],
+                stemMetrics[s],
+                stemMeters[s]);
+            
+            if (--remaining == 0)
+                allDone.signal();
+        });
+    }
+    
+    if (stems.size() > 0)
+        allDone.wait();
+    
+    // common length
+    int numberOfSamples = 0;
+    for (auto* outBuffer : outBuffers)
+        numberOfSamples = jmax (numberOfSamples, outBuffer->getNumSamples());
+    
+    // stems are written padded, so their meters also see the silent tail
+    for (int s = 0; s < outBuffers.size(); ++s)
+    {
+        auto* outBuffer = outBuffers[s];
+        const int renderedSamples = outBuffer->getNumSamples();
+        outBuffer->setSize(outBuffer->getNumChannels(), numberOfSamples, true, true);
+        
+        if (stemMeters[s] != nullptr && renderedSamples < numberOfSamples)
+            stemMeters[s]->process(*outBuffer, renderedSamples, numberOfSamples - renderedSamples);
+    }
+    
+    // sum
+    if (mixBuffer != nullptr)
+    {
+        mixBuffer->setSize(2, numberOfSamples);
+        mixBuffer->clear();
+        for (auto* outBuffer : outBuffers)
+        {
+            for (int c = 0; c < 2; ++c)
+            {
+                mixBuffer->addFrom(c, 0, *outBuffer, c, 0, numberOfSamples);
+            }
+        }
+        
+        if (mixMeter != nullptr)
+            mixMeter->process(*mixBuffer, 0, numberOfSamples);
+    }
+    
+    return true;
+}
+
+
+static bool buffersMatch(
+        const AudioBuffer<float>& a,
+        const AudioBuffer<float>& b,
+        float tolerance)
+{
+    if (a.getNumChannels() != b.getNumChannels() || a.getNumSamples() != b.getNumSamples())
+        return false;
+
+    for (int c = 0; c < a.getNumChannels(); ++c)
+    {
+        const float* x = a.getReadPointer(c);
+        const float* y = b.getReadPointer(c);
+        for (int i = 0; i < a.getNumSamples(); ++i)
+        {
+            if (std::abs (x[i] - y[i]) > tolerance)
+                return false;
         }
+    }
+    return true;
+}
+
 
+struct BufferSizeTuning{
+    int bufferSize;                 // fastest accepted candidate
+    Array<int> candidates;
+    Array<double> milliseconds;     // best timed render per candidate
+    Array<bool> accepted;           // false if the output differed from the reference
+};
+
+
+/*
+ Offline block size auto-tuning.
+ 
+ For every candidate size the processor is re-prepared, warmed up once and then
+ timed over numTimedRuns renders from a clean state; the best run counts, so a
+ single noisy run cannot pick the size. The output rendered with the first candidate is the
+ reference: a candidate whose output differs from it (some plugins break on large
+ blocks) is rejected. render(bufferSize, outBuffer) should render a short probe
+ excerpt, e.g. via renderAudio or renderMidi. The processor is left prepared at
+ the chosen size. Nothing is logged here; the caller reports the result.
+ */
+
+template<class T, class RenderFunction>
+BufferSizeTuning tuneBufferSize(
+        std::unique_ptr<T> &processor,
+        const Array<int>& candidates,
+        int sampleRate,
+        RenderFunction render,
+        int numTimedRuns = 3,
+        float tolerance = 1.0e-5f)
+{
+    AudioBuffer<float> reference;
+    AudioBuffer<float> rendered;
+    BufferSizeTuning result;
+    result.bufferSize = candidates[0];
+    double bestTime = std::numeric_limits<double>::max();
+    
+    auto prepare = [&] (int size)
+    {
+        processor->releaseResources();
+        processor->setRateAndBufferSizeDetails (sampleRate, size);
+        processor->prepareToPlay (sampleRate, size);
+        processor->reset();
+    };
+    
+    for (int i = 0; i < candidates.size(); ++i)
+    {
+        int size = candidates[i];
+        
+        // warm-up
+        prepare (size);
+        render (size, rendered);
+        
+        // timed runs from a clean state
+        double elapsed = std::numeric_limits<double>::max();
+        for (int run = 0; run < jmax (1, numTimedRuns); ++run)
+        {
+            prepare (size);
+            double startTime = Time::getMillisecondCounterHiRes();
+            render (size, rendered);
+            elapsed = jmin (elapsed, Time::getMillisecondCounterHiRes() - startTime);
+        }
+        
+        bool accepted = true;
+        if (i == 0)
+            reference.makeCopyOf(rendered);
+        else
+            accepted = buffersMatch (reference, rendered, tolerance);
+        
+        result.candidates.add(size);
+        result.milliseconds.add(elapsed);
+        result.accepted.add(accepted);
+        
+        if (accepted && elapsed < bestTime)
+        {
+            bestTime = elapsed;
+            result.bufferSize = size;
+        }
     }
+    
+    prepare (result.bufferSize);
+    return result;
 }
 
 
@@ -133,6 +386,10 @@ int main (int argc, char* argv[])
 {
     ScopedJuceInitialiser_GUI initialiser; // required for JUCE console app
 
+    // child process of a sandboxed plugin
+    if (MusicIO::isSandboxWorker(argc, argv))
+        return MusicIO::runSandboxWorker(argc, argv);
+
     String pathToAudioInFile("/Users/wayne391/Documents/Projects/MyPluginHost/console/Source/test.wav");
     String pathToAudioOutFile("/Users/wayne391/Documents/Projects/MyPluginHost/console/Source/test_vsti.wav");
 //    String pathToMidiInFile("/Users/wayne391/Documents/Projects/MyPluginHost/console/Source/test.mid");
@@ -144,9 +401,14 @@ int main (int argc, char* argv[])
     // 1. audio IO
     // read wav file
     int bufferSize = 512;
+    bool autoTuneBufferSize = false;    // costs (1 + 3) probe renders per candidate
+    double probeSeconds = 5.0;
 
-    AudioBuffer<float> inbuffer;
-    auto inputFileInfo = MusicIO::readWavFile(pathToAudioInFile, inbuffer);
+    // decoded once and shared read-only by every job on this file
+    MusicIO::AudioFileInfo inputFileInfo;
+    auto inbuffer = MusicIO::DecodedAudioCache::getInstance().get(pathToAudioInFile, inputFileInfo);
+    if (inbuffer == nullptr)
+        return 1;
     int sampleRate = inputFileInfo.sampleRate;
 //
     // load plugin
@@ -154,6 +416,43 @@ int main (int argc, char* argv[])
             pathToPlugin,
             sampleRate,
             bufferSize, 2, 2);
+
+    // pick the fastest block size for offline rendering
+    if(autoTuneBufferSize)
+    {
+        AudioBuffer<float> probe(
+                inbuffer->getNumChannels(),
+                jmin (inbuffer->getNumSamples(), int (probeSeconds * sampleRate)));
+        for (int c = 0; c < probe.getNumChannels(); ++c)
+            probe.copyFrom(c, 0, *inbuffer, c, 0, probe.getNumSamples());
+
+        auto tuning = tuneBufferSize(
+                plugin,
+                { 512, 1024, 2048, 4096, 8192, 16384 },
+                sampleRate,
+                [&] (int size, AudioBuffer<float>& out)
+                {
+                    renderAudio(probe, out, size, 0, sampleRate, plugin);
+                });
+        
+        for (int i = 0; i < tuning.candidates.size(); ++i)
+        {
+            std::cout << " [tune] block size " << tuning.candidates[i] << ": ";
+            if (tuning.accepted[i])
+                std::cout << tuning.milliseconds[i] << " ms" << std::endl;
+            else
+                std::cout << "output differs, skipped" << std::endl;
+        }
+        
+        bufferSize = tuning.bufferSize;
+        std::cout << " [tune] using block size: " << bufferSize << std::endl;
+    }
+
+    // or, isolated in a worker process
+//    auto plugin = MusicIO::loadSandboxedPlugin(
+//            pathToPlugin,
+//            sampleRate,
+//            bufferSize, 2, 2);
     
     std::cout << "====================" << std::endl;
     auto params = plugin->getParameters();
@@ -173,20 +472,41 @@ int main (int argc, char* argv[])
 //            sampleRate,
 //            bufferSize);
 //
+//    // telemetry, sampled and exported off the render thread
+//    MusicIO::MetricsPoller poller(
+//            1000,
+//            File(pathToAudioOutFile + ".metrics.json"),
+//            MusicIO::MetricsPoller::json);
+//    auto job = MusicIO::RenderMetrics::getInstance().createJob(
+//            pathToAudioOutFile,
+//            pathToPlugin,
+//            sampleRate);
+//    MusicIO::LoudnessMeter meter(sampleRate, inbuffer->getNumChannels());
+//
 //    AudioBuffer<float> outBuffer;
 //    renderAudio(
-//        inbuffer,
+//        *inbuffer,
 //        outBuffer,
-//        512,
+//        bufferSize,
 //        5,
 //        sampleRate,
-//        plugin);
+//        plugin,
+//        job.get(),
+//        &meter);
 //
 //    MusicIO::writeWavFile(
 //            pathToAudioOutFile,
 //            outBuffer,
 //            sampleRate,
 //            16);
+//
+//    // loudness of the render, and an optional gain pass to -23 LUFS
+//    MusicIO::LoudnessInfo loudnessInfo = meter.getInfo();
+//    std::cout << " [loudness] integrated: " << loudnessInfo.integratedLoudness << " LUFS" << std::endl;
+//    std::cout << " [loudness]  true peak: " << loudnessInfo.truePeak << " dBTP" << std::endl;
+//    double appliedGain = 0.0;
+//    if (MusicIO::normaliseWavFile(pathToAudioOutFile, loudnessInfo, appliedGain, -23.0))
+//        std::cout << " [loudness] normalised by " << appliedGain << " dB" << std::endl;
 //
     
     
@@ -234,6 +554,63 @@ int main (int argc, char* argv[])
 //        pathToAudioOutFile,
 //        outBuffer,
 //        sampleRate,
+//        16);
+//
+//    // ====================================================
+//    // render stems, one instrument instance per track
+//
+//    Array<MusicIO::MidiStem> stems;
+//    MusicIO::readMidiStems(pathToMidiInFile, sampleRate, stems);
+//
+//    MusicIO::InstrumentPool instrumentPool(
+//            pathToInstrument,
+//            sampleRate,
+//            bufferSize,
+//            stateString);
+//
+//    OwnedArray<AudioBuffer<float>> stemBuffers;
+//    AudioBuffer<float> mixBuffer;
+//
+//    // per-stem telemetry and loudness, and loudness of the mix
+//    Array<MusicIO::JobMetrics*> stemMetrics;
+//    Array<MusicIO::LoudnessMeter*> stemMeters;
+//    std::vector<std::shared_ptr<MusicIO::JobMetrics>> stemJobs;
+//    OwnedArray<MusicIO::LoudnessMeter> meters;
+//    for (auto& stem : stems)
+//    {
+//        stemJobs.push_back(MusicIO::RenderMetrics::getInstance().createJob(stem.name, pathToInstrument, sampleRate));
+//        stemMetrics.add(stemJobs.back().get());
+//        stemMeters.add(meters.add(new MusicIO::LoudnessMeter(sampleRate, 2)));
+//    }
+//    MusicIO::LoudnessMeter mixMeter(sampleRate, 2);
+//
+//    if (!renderMidiStems(
+//            stems,
+//            instrumentPool.acquire(stems.size()),
+//            stemBuffers,
+//            &mixBuffer,
+//            bufferSize,
+//            5,
+//            sampleRate,
+//            stemMetrics,
+//            stemMeters,
+//            &mixMeter))
+//        return 1;
+//
+//    File outFile(pathToAudioOutFile);
+//    for (int s = 0; s < stems.size(); ++s)
+//    {
+//        MusicIO::writeWavFile(
+//            outFile.getSiblingFile(outFile.getFileNameWithoutExtension() + "_" + stems[s].name.replace(" ", "_") + ".wav").getFullPathName(),
+//            *stemBuffers[s],
+//            sampleRate,
+//            16);
+//    }
+//
+//    MusicIO::writeWavFile(
+//        pathToAudioOutFile,
+//        mixBuffer,
+//        sampleRate,
 //        16);
     return 0;
 }
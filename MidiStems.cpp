@@ -0,0 +1,118 @@
+//
+//  MidiStems.cpp
+//  console_renderer - ConsoleApp
+//
+//  Per-track / per-channel MIDI stems.
+//
+
+#include "MidiStems.hpp"
+
+
+using namespace juce;
+
+void MusicIO::readMidiStems(
+    String pathToMidiInFile,
+    int sampleRate,
+    Array<MidiStem>& stems,
+    bool splitByChannel)
+{
+    FileInputStream fileStream(pathToMidiInFile);
+    
+    // load file
+    MidiFile Mfile;
+    Mfile.readFrom(fileStream);
+    Mfile.convertTimestampTicksToSeconds();
+    
+    stems.clear();
+    
+    if (splitByChannel)
+    {
+        MidiStem channelStems[16];
+        for (int t = 0; t < Mfile.getNumTracks(); t++) {
+            const MidiMessageSequence* track = Mfile.getTrack(t);
+            for (int i = 0; i < track->getNumEvents(); i++) {
+                MidiMessage& m = track->getEventPointer(i)->message;
+                int channel = m.getChannel();
+                if (channel == 0)
+                    continue; // meta and sysex events belong to no channel
+                
+                int sampleOffset = (int)(sampleRate * m.getTimeStamp());
+                channelStems[channel - 1].midiBuffer.addEvent(m, sampleOffset);
+            }
+        }
+        
+        for (int c = 0; c < 16; ++c)
+        {
+            if (channelStems[c].midiBuffer.isEmpty())
+                continue;
+            
+            channelStems[c].name = "channel " + String (c + 1);
+            stems.add(channelStems[c]);
+        }
+        return;
+    }
+    
+    for (int t = 0; t < Mfile.getNumTracks(); t++) {
+        const MidiMessageSequence* track = Mfile.getTrack(t);
+        MidiStem stem;
+        bool hasChannelEvents = false;
+        
+        for (int i = 0; i < track->getNumEvents(); i++) {
+            MidiMessage& m = track->getEventPointer(i)->message;
+            hasChannelEvents = hasChannelEvents || ! m.isMetaEvent();
+            
+            int sampleOffset = (int)(sampleRate * m.getTimeStamp());
+            stem.midiBuffer.addEvent(m, sampleOffset);
+        }
+        
+        if (! hasChannelEvents)
+            continue;
+        
+        stem.name = "track " + String (t + 1);
+        stems.add(stem);
+    }
+}
+
+//==============================================================================
+// Instrument pool
+
+MusicIO::InstrumentPool::InstrumentPool(
+    String pathToPlugin,
+    int rate,
+    int blockSize,
+    String state)
+    : pathToInstrument (pathToPlugin),
+      sampleRate (rate),
+      bufferSize (blockSize),
+      stateString (state)
+{
+}
+
+std::vector<std::unique_ptr<AudioPluginInstance>>& MusicIO::InstrumentPool::acquire(int numInstances)
+{
+    // instances already in the pool: back to the state they were loaded with,
+    // which also undoes Program Change and CC messages of the previous stem
+    for (size_t i = 0; i < instances.size(); ++i)
+    {
+        instances[i]->reset();
+        instances[i]->setStateInformation (initialStates[i].getData(), (int) initialStates[i].getSize());
+    }
+    
+    // loaded (and prepared) only when the pool is too small
+    while ((int) instances.size() < numInstances)
+    {
+        instances.push_back (loadPlugin(
+                pathToInstrument,
+                sampleRate,
+                bufferSize,
+                1,
+                2,
+                true,
+                stateString));
+        
+        initialStates.emplace_back();
+        instances.back()->getStateInformation (initialStates.back());
+    }
+    
+    return instances;
+}
@@ -0,0 +1,69 @@
+//
+//  MidiStems.hpp
+//  console_renderer - ConsoleApp
+//
+//  Per-track / per-channel MIDI stems.
+//
+
+#ifndef MidiStems_hpp
+#define MidiStems_hpp
+
+#include <JuceHeader.h>
+#include "MusicIO.hpp"
+
+#include <vector>
+
+using namespace juce;
+
+
+namespace MusicIO {
+
+struct MidiStem{
+    String name;            // "track 3", "channel 10"
+    MidiBuffer midiBuffer;
+};
+
+// Parses the file once and splits it by track, or by MIDI channel. Tracks or
+// channels without any non-meta event (e.g. a tempo track) produce no stem.
+void readMidiStems(
+        String pathToMidiInFile,
+        int sampleRate,
+        Array<MidiStem>& stems,
+        bool splitByChannel=false);
+
+
+/*
+ Instances of one instrument, loaded once and handed out again for every stem
+ render instead of being re-instantiated per stem. Each instance's state is
+ snapshotted right after loading, and acquire() restores every instance it
+ returns to that snapshot, so programs and controllers set by one stem's MIDI
+ never carry over to the next.
+ */
+
+class InstrumentPool
+{
+public:
+    InstrumentPool(
+            String pathToInstrument,
+            int sampleRate,
+            int bufferSize,
+            String stateString="");
+
+    std::vector<std::unique_ptr<AudioPluginInstance>>& acquire(int numInstances);
+    int size() const                                             { return (int) instances.size(); }
+
+private:
+    String pathToInstrument;
+    int sampleRate;
+    int bufferSize;
+    String stateString;
+    std::vector<std::unique_ptr<AudioPluginInstance>> instances;
+    std::vector<MemoryBlock> initialStates;     // getStateInformation right after loading
+    //==============================================================================
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (InstrumentPool)
+};
+
+} // namespace MusicIO
+
+
+#endif /* MidiStems_hpp */
@@ -6,6 +6,7 @@
 //
 
 #include "MusicIO.hpp"
+#include "RenderMetrics.hpp"
 
 
 using namespace juce;
@@ -20,7 +21,7 @@ MusicIO::AudioFileInfo MusicIO::readWavFile(
     AudioBuffer<float>& inBuffer,
     bool isMono)
 {
-    AudioFileInfo inputFileInfo;
+    AudioFileInfo inputFileInfo {};
     AudioFormatManager formatManager;
     
     formatManager.registerBasicFormats();
@@ -44,14 +45,17 @@ MusicIO::AudioFileInfo MusicIO::readWavFile(
                      0,
                      true,
                      flag);
+
+        inputFileInfo.sampleRate = (int)reader->sampleRate;
+        inputFileInfo.bitsPerSample = (int)reader->bitsPerSample;
+        inputFileInfo.sampleLength = (int)reader->lengthInSamples;
+        inputFileInfo.numChannels = numChannels;
+
+        auto& metrics = RenderMetrics::getInstance();
+        metrics.filesRead += 1;
+        metrics.bytesRead += File (pathToAudioInFile).getSize();
     }
-    inputFileInfo.sampleRate = (int)reader->sampleRate;
-    inputFileInfo.bitsPerSample = (int)reader->bitsPerSample;
-    inputFileInfo.sampleLength = (int)reader->lengthInSamples;
-    inputFileInfo.numChannels = numChannels;
     
-    std::cout << "sampleLength:" << inputFileInfo.sampleLength << std::endl;
-    std::cout << "numChannels:" << inputFileInfo.numChannels << std::endl;
     return inputFileInfo;
 }
 
@@ -78,7 +82,14 @@ void MusicIO::writeWavFile(
         0));
 
     if (writer != nullptr)
+    {
         writer->writeFromAudioSampleBuffer(outBuffer, 0, outBuffer.getNumSamples());
+        writer.reset();
+
+        auto& metrics = RenderMetrics::getInstance();
+        metrics.filesWritten += 1;
+        metrics.bytesWritten += outFile.getSize();
+    }
 }
 
 
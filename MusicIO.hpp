@@ -23,6 +23,14 @@ struct AudioFileInfo{
     int numChannels;
 };
 
+// EBU R128 / ITU-R BS.1770 measurements of a render, see LoudnessMeter
+struct LoudnessInfo{
+    double integratedLoudness;  // LUFS, -inf if everything is gated out
+    double truePeak;            // dBTP, 4x oversampled
+    double samplePeak;          // dBFS
+    Array<double> rms;          // dBFS per channel
+};
+
 // Graph processor
 class GraphRunnerProcessor : public juce::AudioProcessor
 {
@@ -224,25 +232,21 @@ private:
            
            if (pluginName == "Audio Input")
            {
-               std::cout << "Audio Input Detected " << std::endl;
                audioInputDummy = currentNode;
            }
             
            if (pluginName == "MIDI Input")
            {
-               std::cout << "Midi Input Detected " << std::endl;
                audioOutputDummy = currentNode;
            }
            
            if (pluginName == "Audio Output")
            {
-               std::cout << "Audio Output Detected " << std::endl;
                audioOutputDummy = currentNode;
            }
 
            if (pluginName == "MIDIOutput")
            {
-               std::cout << "Midi Output Detected " << std::endl;
                midiOutputDummy = currentNode;
            }
        }
@@ -258,7 +262,6 @@ private:
             // Inputs
             if(audioInputDummy == srcNode)
             {
-                std::cout << "audio Input Connected " << std::endl;
                 mainProcessor->addConnection ({
                     { audioInputNode->nodeID, srcChannel},
                     { dstNode, dstCahnnel}});
@@ -266,7 +269,6 @@ private:
             }
             
             if(midiInputDummy == srcNode){
-                std::cout << "midi Input Connected " << std::endl;
                 mainProcessor->addConnection ({
                     { midiInputNode->nodeID, srcChannel},
                     { dstNode, dstCahnnel}});
@@ -276,7 +278,6 @@ private:
             // Outputs
             if(audioOutputDummy == dstNode)
             {
-                std::cout << "Audio Output Connected " << std::endl;
                 mainProcessor->addConnection ({
                    { srcNode, srcChannel},
                    { audioOutputNode->nodeID, dstCahnnel}});
@@ -285,7 +286,6 @@ private:
 
             if(audioOutputDummy == dstNode)
            {
-               std::cout << "Midi Output Connected " << std::endl;
                mainProcessor->addConnection ({
                   { srcNode, srcChannel},
                   { midiOutputNode->nodeID, dstCahnnel}});
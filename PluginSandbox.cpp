@@ -0,0 +1,768 @@
+//
+//  PluginSandbox.cpp
+//  console_renderer - ConsoleApp
+//
+//  Out-of-process plugin host.
+//
+
+#include "PluginSandbox.hpp"
+#include "RenderMetrics.hpp"
+
+#if JUCE_MAC || JUCE_LINUX
+ #include <sys/mman.h>
+ #include <fcntl.h>
+ #include <semaphore.h>
+ #include <unistd.h>
+ #include <time.h>
+ #include <errno.h>
+#endif
+
+
+using namespace juce;
+
+namespace
+{
+    const char* workerFlag = "--sandbox-worker";
+    const uint32 sharedMagic = 0x4d494f53;
+
+    enum Command
+    {
+        cmdReady = 0,   // posted by the worker once the plugin is loaded
+        cmdPrepare,
+        cmdRelease,
+        cmdReset,
+        cmdProcess,
+        cmdQuit
+    };
+
+    // Start of the shared region. It is followed by the plugin path and state
+    // strings, the audio channels (maxBlockSize floats each) and the MIDI bytes.
+    struct SharedHeader
+    {
+        uint32 magic;
+        uint32 totalSize;
+
+        // the worker echoes requestSequence into replySequence, so a late reply
+        // to an earlier command is never taken for the current one
+        std::atomic<uint32> requestSequence { 0 };
+        std::atomic<uint32> replySequence { 0 };
+
+        // written once by the parent
+        int32 isGraph;
+        int32 isInstrument;
+        int32 inChannel;
+        int32 outChannel;
+        int32 maxChannels;
+        int32 maxBlockSize;
+        int32 midiCapacity;
+        int32 pathBytes;
+        int32 stateBytes;
+
+        // per command
+        int32 command;
+        int32 sampleRate;
+        int32 blockSize;
+        int32 numSamples;
+        int32 numChannels;
+        int32 midiBytes;
+        int32 status;
+        int64 cpuNanoseconds;   // worker thread CPU time spent in processBlock
+
+        // written by the worker once ready
+        int32 numInputChannels;
+        int32 numOutputChannels;
+    };
+
+    size_t alignTo (size_t n, size_t alignment)     { return (n + alignment - 1) & ~(alignment - 1); }
+
+    size_t configOffset()                           { return alignTo (sizeof (SharedHeader), 64); }
+    size_t audioOffset (const SharedHeader& h)      { return alignTo (configOffset() + (size_t) h.pathBytes + (size_t) h.stateBytes, 64); }
+    size_t midiOffset (const SharedHeader& h)       { return alignTo (audioOffset (h) + sizeof (float) * (size_t) h.maxChannels * (size_t) h.maxBlockSize, 64); }
+    size_t totalSize (const SharedHeader& h)        { return midiOffset (h) + (size_t) h.midiCapacity; }
+
+    // MIDI events are packed as { int32 samplePosition, int32 numBytes, bytes } on 4-byte boundaries
+    int writeMidi (const MidiBuffer& midi, uint8* dest, int capacity)
+    {
+        int pos = 0;
+        for (const auto metadata : midi)
+        {
+            const int needed = 8 + (int) alignTo ((size_t) metadata.numBytes, 4);
+            if (pos + needed > capacity)
+            {
+                jassertfalse; // events that do not fit are dropped
+                break;
+            }
+
+            const int32 eventHeader[2] = { metadata.samplePosition, metadata.numBytes };
+            memcpy (dest + pos, eventHeader, sizeof (eventHeader));
+            memcpy (dest + pos + 8, metadata.data, (size_t) metadata.numBytes);
+            pos += needed;
+        }
+        return pos;
+    }
+
+    void readMidi (const uint8* src, int numBytes, MidiBuffer& midi)
+    {
+        midi.clear();
+        int pos = 0;
+        while (pos + 8 <= numBytes)
+        {
+            int32 eventHeader[2];
+            memcpy (eventHeader, src + pos, sizeof (eventHeader));
+            midi.addEvent (src + pos + 8, eventHeader[1], eventHeader[0]);
+            pos += 8 + (int) alignTo ((size_t) eventHeader[1], 4);
+        }
+    }
+}
+
+//==============================================================================
+// Shared memory and semaphores
+
+struct MusicIO::SandboxSharedRegion
+{
+    ~SandboxSharedRegion()
+    {
+        unlink();
+
+       #if JUCE_MAC || JUCE_LINUX
+        if (data != nullptr)        munmap (data, size);
+        if (fd >= 0)                close (fd);
+        if (request != SEM_FAILED)  sem_close (request);
+        if (reply != SEM_FAILED)    sem_close (reply);
+       #endif
+    }
+
+    // Removes the names once both sides hold the objects open, so nothing is
+    // left behind in /dev/shm if either process dies.
+    void unlink()
+    {
+       #if JUCE_MAC || JUCE_LINUX
+        if (isOwner && isLinked)
+        {
+            shm_unlink ((baseName + "m").toRawUTF8());
+            sem_unlink ((baseName + "q").toRawUTF8());
+            sem_unlink ((baseName + "r").toRawUTF8());
+        }
+       #endif
+        isLinked = false;
+    }
+
+    // parent side, the name is kept short for the 31 character limit on macOS
+    bool create (size_t bytes)
+    {
+       #if JUCE_MAC || JUCE_LINUX
+        static std::atomic<int> counter { 0 };
+        baseName = "/mio" + String ((int) getpid()) + "-" + String (++counter);
+        isOwner = true;
+        isLinked = true;
+
+        fd = shm_open ((baseName + "m").toRawUTF8(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0 || ftruncate (fd, (off_t) bytes) != 0)
+            return false;
+
+        request = sem_open ((baseName + "q").toRawUTF8(), O_CREAT | O_EXCL, 0600, 0);
+        reply   = sem_open ((baseName + "r").toRawUTF8(), O_CREAT | O_EXCL, 0600, 0);
+        return request != SEM_FAILED && reply != SEM_FAILED && map (bytes);
+       #else
+        ignoreUnused (bytes);
+        return false;
+       #endif
+    }
+
+    // worker side
+    bool open (const String& name)
+    {
+       #if JUCE_MAC || JUCE_LINUX
+        baseName = name;
+
+        fd = shm_open ((baseName + "m").toRawUTF8(), O_RDWR, 0600);
+        if (fd < 0 || ! map (sizeof (SharedHeader)))
+            return false;
+
+        if (header().magic != sharedMagic)
+            return false;
+
+        const size_t bytes = header().totalSize;
+        munmap (data, size);
+        data = nullptr;
+
+        request = sem_open ((baseName + "q").toRawUTF8(), 0);
+        reply   = sem_open ((baseName + "r").toRawUTF8(), 0);
+        return request != SEM_FAILED && reply != SEM_FAILED && map (bytes);
+       #else
+        ignoreUnused (name);
+        return false;
+       #endif
+    }
+
+    void post (void* sem)
+    {
+       #if JUCE_MAC || JUCE_LINUX
+        sem_post (static_cast<sem_t*> (sem));
+       #else
+        ignoreUnused (sem);
+       #endif
+    }
+
+    // blocks until posted, timeouts are left to the caller's watchdog
+    void wait (void* sem)
+    {
+       #if JUCE_MAC || JUCE_LINUX
+        while (sem_wait (static_cast<sem_t*> (sem)) != 0 && errno == EINTR)
+        {
+        }
+       #else
+        ignoreUnused (sem);
+       #endif
+    }
+
+    SharedHeader& header()      { return *static_cast<SharedHeader*> (data); }
+    char* config()              { return static_cast<char*> (data) + configOffset(); }
+    uint8* midi()               { return static_cast<uint8*> (data) + midiOffset (header()); }
+    float* channel (int c)
+    {
+        auto* audio = reinterpret_cast<float*> (static_cast<uint8*> (data) + audioOffset (header()));
+        return audio + (size_t) c * (size_t) header().maxBlockSize;
+    }
+
+    String baseName;
+    bool isOwner = false;
+    bool isLinked = false;
+    int fd = -1;
+    void* data = nullptr;
+    size_t size = 0;
+   #if JUCE_MAC || JUCE_LINUX
+    sem_t* request = SEM_FAILED;
+    sem_t* reply = SEM_FAILED;
+   #else
+    void* request = nullptr;
+    void* reply = nullptr;
+   #endif
+
+private:
+    bool map (size_t bytes)
+    {
+       #if JUCE_MAC || JUCE_LINUX
+        data = mmap (nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            data = nullptr;
+            return false;
+        }
+        size = bytes;
+        return true;
+       #else
+        ignoreUnused (bytes);
+        return false;
+       #endif
+    }
+};
+
+//==============================================================================
+// Parent side
+
+// Wakes the parent out of sem_wait when the worker exits or the command in
+// flight passes its deadline. It polls every 20 ms, independently of the blocks.
+class MusicIO::SandboxedProcessor::Watchdog : public juce::Thread
+{
+public:
+    Watchdog (SandboxedProcessor& processor)
+        : Thread ("SandboxWatchdog"), owner (processor)
+    {
+        startThread();
+    }
+
+    ~Watchdog() override
+    {
+        stopThread (1000);
+    }
+
+    void run() override
+    {
+        while (! threadShouldExit())
+        {
+            wait (intervalMs);
+
+            auto deadline = owner.pendingDeadline.load();
+            if (deadline == 0)
+                continue;
+
+            const auto sequence = owner.pendingSequence.load();
+            const ScopedLock sl (owner.workerLock);
+
+            if (owner.shared == nullptr)
+                continue;
+
+            if (Time::currentTimeMillis() < deadline && owner.worker.isRunning())
+                continue;
+
+            // only if the parent has not moved on to another command meanwhile
+            if (owner.pendingDeadline.compare_exchange_strong (deadline, 0))
+            {
+                owner.expiredSequence = sequence;
+                owner.shared->post (owner.shared->reply);
+            }
+        }
+    }
+
+private:
+    static constexpr int intervalMs = 20;
+    SandboxedProcessor& owner;
+};
+
+MusicIO::SandboxedProcessor::SandboxedProcessor(const SandboxConfig& sandboxConfig)
+    : AudioProcessor (BusesProperties().withInput  ("Input",  juce::AudioChannelSet::stereo(), true)
+                                       .withOutput ("Output", juce::AudioChannelSet::stereo(), true)),
+      config (sandboxConfig)
+{
+    watchdog.reset (new Watchdog (*this));
+
+    if (! startWorker())
+        failed = true;
+}
+
+MusicIO::SandboxedProcessor::~SandboxedProcessor()
+{
+    stopWorker();
+    watchdog.reset();
+}
+
+bool MusicIO::SandboxedProcessor::isWorkerRunning() const
+{
+    const ScopedLock sl (workerLock);
+    return shared != nullptr && worker.isRunning();
+}
+
+bool MusicIO::SandboxedProcessor::startWorker()
+{
+    const auto path = config.pathToPlugin.toStdString();
+    const auto state = config.stateString.toStdString();
+
+    auto fillHeader = [&] (SharedHeader& h)
+    {
+        h.magic = sharedMagic;
+        h.isGraph = config.isGraph ? 1 : 0;
+        h.isInstrument = config.isInstrument ? 1 : 0;
+        h.inChannel = config.inChannel;
+        h.outChannel = config.outChannel;
+        h.maxChannels = config.maxChannels;
+        h.maxBlockSize = config.bufferSize;
+        h.midiCapacity = config.midiCapacity;
+        h.pathBytes = (int32) path.size() + 1;
+        h.stateBytes = (int32) state.size() + 1;
+        h.sampleRate = config.sampleRate;
+        h.blockSize = config.bufferSize;
+        h.status = -1;
+        h.totalSize = (uint32) totalSize (h);
+    };
+
+    SharedHeader layout;
+    fillHeader (layout);
+
+    {
+        const ScopedLock sl (workerLock);
+
+        shared.reset (new SandboxSharedRegion());
+        if (! shared->create (layout.totalSize))
+        {
+            shared.reset();
+            return false;
+        }
+
+        auto& h = *new (shared->data) SharedHeader();
+        fillHeader (h);
+
+        // the worker answers cmdReady with the sequence it finds here
+        h.requestSequence = ++nextSequence;
+        memcpy (shared->config(), path.c_str(), (size_t) h.pathBytes);
+        memcpy (shared->config() + h.pathBytes, state.c_str(), (size_t) h.stateBytes);
+
+        StringArray args;
+        args.add (File::getSpecialLocation (File::currentExecutableFile).getFullPathName());
+        args.add (workerFlag);
+        args.add (shared->baseName);
+
+        // no stream flags: the worker's output is not piped back
+        if (! worker.start (args, 0))
+        {
+            shared.reset();
+            return false;
+        }
+    }
+
+    // the worker answers once the plugin is loaded and prepared
+    if (! sendCommand (cmdReady))
+    {
+        stopWorker();
+        return false;
+    }
+
+    // both sides have everything open now
+    shared->unlink();
+
+    auto& ready = shared->header();
+    setPlayConfigDetails (ready.numInputChannels, ready.numOutputChannels,
+                          config.sampleRate, config.bufferSize);
+    return true;
+}
+
+void MusicIO::SandboxedProcessor::stopWorker()
+{
+    const ScopedLock sl (workerLock);
+
+    if (isWorkerRunning())
+    {
+        shared->header().command = cmdQuit;
+        shared->header().requestSequence = ++nextSequence;
+        shared->post (shared->request);
+
+        if (! worker.waitForProcessToFinish (1000))
+            worker.kill();
+    }
+    else if (worker.isRunning())
+    {
+        worker.kill();
+    }
+
+    shared.reset();
+}
+
+bool MusicIO::SandboxedProcessor::restartWorker()
+{
+    stopWorker();
+
+    while (numRestarts < config.maxRestarts)
+    {
+        ++numRestarts;
+        if (startWorker())
+            return true;
+    }
+
+    failed = true;
+    return false;
+}
+
+bool MusicIO::SandboxedProcessor::sendCommand (int command)
+{
+    if (shared == nullptr)
+        return false;
+
+    auto& h = shared->header();
+
+    // cmdReady only waits: the worker posts it unprompted once loaded
+    uint32 sequence = h.requestSequence;
+    if (command != cmdReady)
+    {
+        sequence = ++nextSequence;
+        h.status = -1;
+        h.command = command;
+        h.requestSequence = sequence;
+    }
+
+    // arm the watchdog, sequence first so it never pairs a deadline with an older one
+    pendingSequence = sequence;
+    pendingDeadline = Time::currentTimeMillis() + config.timeoutMs;
+
+    if (command != cmdReady)
+        shared->post (shared->request);
+
+    for (;;)
+    {
+        shared->wait (shared->reply);
+
+        if (h.replySequence == sequence)
+        {
+            pendingDeadline = 0;
+            return h.status == 0;
+        }
+
+        // crashed or hung
+        if (expiredSequence == sequence)
+            return false;
+
+        // otherwise a stale post for an earlier command, keep waiting
+    }
+}
+
+bool MusicIO::SandboxedProcessor::runCommand (int command)
+{
+    if (failed)
+        return false;
+
+    if (sendCommand (command))
+        return true;
+
+    restartWorker();
+    return false;
+}
+
+void MusicIO::SandboxedProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
+{
+    if (failed)
+        return;
+
+    if (isWorkerRunning() && (int) sampleRate == config.sampleRate
+         && samplesPerBlock <= shared->header().maxBlockSize)
+    {
+        shared->header().sampleRate = (int) sampleRate;
+        shared->header().blockSize = samplesPerBlock;
+
+        // on failure the restarted worker comes up prepared
+        runCommand (cmdPrepare);
+        return;
+    }
+
+    // larger blocks than the shared region holds, a new rate, or a dead worker
+    config.sampleRate = (int) sampleRate;
+    config.bufferSize = samplesPerBlock;
+    stopWorker();
+
+    if (! startWorker())
+        restartWorker();
+}
+
+void MusicIO::SandboxedProcessor::releaseResources()
+{
+    if (isWorkerRunning())
+        runCommand (cmdRelease);
+}
+
+void MusicIO::SandboxedProcessor::reset()
+{
+    if (isWorkerRunning())
+        runCommand (cmdReset);
+}
+
+void MusicIO::SandboxedProcessor::processBlock (juce::AudioSampleBuffer& buffer, juce::MidiBuffer& midiMessages)
+{
+    const int numSamples = buffer.getNumSamples();
+
+    if (failed || shared == nullptr || numSamples > shared->header().maxBlockSize)
+    {
+        jassert (failed || shared == nullptr); // blocks must not exceed the prepared size
+        buffer.clear();
+        midiMessages.clear();
+        ++numDroppedBlocks;
+        return;
+    }
+
+    auto& h = shared->header();
+    const int numChannels = jmin (buffer.getNumChannels(), (int) h.maxChannels);
+    lastBlockCpuNanoseconds = 0;
+
+    for (int c = 0; c < numChannels; ++c)
+        FloatVectorOperations::copy (shared->channel (c), buffer.getReadPointer (c), numSamples);
+
+    h.numSamples = numSamples;
+    h.numChannels = numChannels;
+    h.midiBytes = writeMidi (midiMessages, shared->midi(), h.midiCapacity);
+
+    if (! runCommand (cmdProcess))
+    {
+        // the block in flight is lost, the worker restarts from its initial state
+        buffer.clear();
+        midiMessages.clear();
+        ++numDroppedBlocks;
+        return;
+    }
+
+    lastBlockCpuNanoseconds = h.cpuNanoseconds;
+
+    const int numReturned = jmin (buffer.getNumChannels(), (int) h.numChannels);
+    for (int c = 0; c < numReturned; ++c)
+        FloatVectorOperations::copy (buffer.getWritePointer (c), shared->channel (c), numSamples);
+
+    for (int c = numReturned; c < buffer.getNumChannels(); ++c)
+        buffer.clear (c, 0, numSamples);
+
+    readMidi (shared->midi(), h.midiBytes, midiMessages);
+}
+
+//==============================================================================
+// Loaders
+
+std::unique_ptr<MusicIO::SandboxedProcessor> MusicIO::loadSandboxedPlugin(
+    String pathToPlugin,
+    int sampleRate,
+    int bufferSize,
+    int inChannel,
+    int outChannel,
+    bool isInstrument,
+    String stateString)
+{
+    SandboxConfig config;
+    config.pathToPlugin = pathToPlugin;
+    config.isInstrument = isInstrument;
+    config.stateString = stateString;
+    config.sampleRate = sampleRate;
+    config.bufferSize = bufferSize;
+    config.inChannel = inChannel;
+    config.outChannel = outChannel;
+
+    std::unique_ptr<SandboxedProcessor> sandbox(new SandboxedProcessor(config));
+    if (sandbox->hasFailed())
+        return nullptr;
+
+    sandbox->setNonRealtime (true);
+    return sandbox;
+}
+
+std::unique_ptr<MusicIO::SandboxedProcessor> MusicIO::loadSandboxedGraph(
+    String pathToGraph,
+    int sampleRate,
+    int bufferSize)
+{
+    SandboxConfig config;
+    config.pathToPlugin = pathToGraph;
+    config.isGraph = true;
+    config.sampleRate = sampleRate;
+    config.bufferSize = bufferSize;
+
+    std::unique_ptr<SandboxedProcessor> sandbox(new SandboxedProcessor(config));
+    if (sandbox->hasFailed())
+        return nullptr;
+
+    sandbox->setNonRealtime (true);
+    return sandbox;
+}
+
+//==============================================================================
+// Worker side
+
+namespace
+{
+    // The worker blocks in sem_wait, so the parent's death is noticed here.
+    class ParentWatchdog : public juce::Thread
+    {
+    public:
+        ParentWatchdog()
+            : Thread ("ParentWatchdog")
+        {
+           #if JUCE_MAC || JUCE_LINUX
+            parent = getppid();
+           #endif
+            startThread();
+        }
+
+        ~ParentWatchdog() override
+        {
+            stopThread (1000);
+        }
+
+        void run() override
+        {
+            while (! threadShouldExit())
+            {
+                wait (500);
+               #if JUCE_MAC || JUCE_LINUX
+                if (getppid() != parent)
+                    Process::terminate();
+               #endif
+            }
+        }
+
+    private:
+        int parent = 0;
+    };
+}
+
+bool MusicIO::isSandboxWorker(int argc, char* argv[])
+{
+    return argc >= 3 && String (argv[1]) == workerFlag;
+}
+
+int MusicIO::runSandboxWorker(int argc, char* argv[])
+{
+   #if JUCE_MAC || JUCE_LINUX
+    if (! isSandboxWorker (argc, argv))
+        return 1;
+
+    SandboxSharedRegion shared;
+    if (! shared.open (argv[2]))
+        return 1;
+
+    auto& h = shared.header();
+    const char* config = shared.config();
+    String path = String::fromUTF8 (config, h.pathBytes - 1);
+    String state = String::fromUTF8 (config + h.pathBytes, h.stateBytes - 1);
+
+    // a plugin that fails to load takes only this process down
+    std::unique_ptr<AudioProcessor> processor;
+    if (h.isGraph)
+        processor = loadGraph (path, h.sampleRate, h.blockSize);
+    else
+        processor = loadPlugin (path, h.sampleRate, h.blockSize, h.inChannel, h.outChannel,
+                                h.isInstrument != 0, state);
+
+    const int numChannels = jmax (processor->getTotalNumInputChannels(),
+                                  processor->getTotalNumOutputChannels());
+    h.numInputChannels = processor->getTotalNumInputChannels();
+    h.numOutputChannels = processor->getTotalNumOutputChannels();
+    h.status = numChannels <= h.maxChannels ? 0 : -1;
+    h.replySequence = h.requestSequence.load();
+    shared.post (shared.reply);
+
+    if (h.status != 0)
+        return 1;
+
+    // process in place on the shared channels
+    HeapBlock<float*> channels ((size_t) numChannels);
+    for (int c = 0; c < numChannels; ++c)
+        channels[c] = shared.channel (c);
+
+    MidiBuffer midi;
+    ParentWatchdog parentWatchdog;
+
+    for (;;)
+    {
+        shared.wait (shared.request);
+        const uint32 sequence = h.requestSequence;
+
+        switch (h.command)
+        {
+            case cmdPrepare:
+                processor->setRateAndBufferSizeDetails (h.sampleRate, h.blockSize);
+                processor->prepareToPlay (h.sampleRate, h.blockSize);
+                break;
+
+            case cmdRelease:
+                processor->releaseResources();
+                break;
+
+            case cmdReset:
+                processor->reset();
+                break;
+
+            case cmdProcess:
+            {
+                AudioBuffer<float> buffer (channels.get(), numChannels, h.numSamples);
+                for (int c = h.numChannels; c < numChannels; ++c)
+                    buffer.clear (c, 0, h.numSamples);
+
+                readMidi (shared.midi(), h.midiBytes, midi);
+                const int64 cpuStart = RenderMetrics::getThreadCpuNanoseconds();
+                processor->processBlock (buffer, midi);
+                h.cpuNanoseconds = RenderMetrics::getThreadCpuNanoseconds() - cpuStart;
+
+                h.midiBytes = writeMidi (midi, shared.midi(), h.midiCapacity);
+                h.numChannels = numChannels;
+                break;
+            }
+
+            case cmdQuit:
+                processor->releaseResources();
+                return 0;
+
+            default:
+                break;
+        }
+
+        h.status = 0;
+        h.replySequence = sequence;
+        shared.post (shared.reply);
+    }
+   #else
+    ignoreUnused (argc, argv);
+    return 1;
+   #endif
+}
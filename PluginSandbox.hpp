@@ -0,0 +1,140 @@
+//
+//  PluginSandbox.hpp
+//  console_renderer - ConsoleApp
+//
+//  Out-of-process plugin host.
+//
+
+#ifndef PluginSandbox_hpp
+#define PluginSandbox_hpp
+
+#include <JuceHeader.h>
+#include "MusicIO.hpp"
+
+using namespace juce;
+
+
+namespace MusicIO {
+
+/*
+ The plugin (or graph) runs in a worker process: a copy of this executable
+ started with `--sandbox-worker <name>`. Audio and MIDI blocks are exchanged
+ through a shared-memory region, and the two sides wake each other with a pair
+ of named POSIX semaphores. Both sides block in sem_wait; a watchdog thread
+ wakes the parent if the worker dies or misses the timeout. The worker is then
+ killed and restarted from the initial state, and the block in flight is
+ rendered as silence. After maxRestarts the processor gives up: hasFailed()
+ turns true and every further block is dropped.
+ */
+
+struct SandboxConfig{
+    String pathToPlugin;        // plugin file, or a .filtergraph when isGraph
+    bool isGraph = false;
+    bool isInstrument = false;
+    String stateString;
+    int sampleRate = 44100;
+    int bufferSize = 512;
+    int inChannel = 2;
+    int outChannel = 2;
+    int maxChannels = 16;       // channel capacity of the shared region
+    int midiCapacity = 65536;   // bytes of MIDI per block, each way
+    int timeoutMs = 30000;      // per block, and for loading the plugin
+    int maxRestarts = 3;
+};
+
+struct SandboxSharedRegion;
+
+// Sandboxed processor
+class SandboxedProcessor : public juce::AudioProcessor
+{
+public:
+    //==============================================================================
+    SandboxedProcessor(const SandboxConfig& config);
+    ~SandboxedProcessor() override;
+
+    bool isWorkerRunning() const;
+    bool hasFailed() const                                       { return failed; }
+    int getNumRestarts() const                                   { return numRestarts; }
+    int getNumDroppedBlocks() const                              { return numDroppedBlocks; }
+    int64 getLastBlockCpuNanoseconds() const                     { return lastBlockCpuNanoseconds; }
+
+    //==============================================================================
+    void prepareToPlay (double sampleRate, int samplesPerBlock) override;
+    void releaseResources() override;
+    void reset() override;
+    void processBlock (juce::AudioSampleBuffer& buffer, juce::MidiBuffer& midiMessages) override;
+
+    //==============================================================================
+    juce::AudioProcessorEditor* createEditor() override          { return nullptr; }
+    bool hasEditor() const override                              { return false; }
+
+    //==============================================================================
+    const juce::String getName() const override                  { return "Sandbox"; }
+    bool acceptsMidi() const override                            { return true; }
+    bool producesMidi() const override                           { return true; }
+    double getTailLengthSeconds() const override                 { return 0; }
+
+    //==============================================================================
+    int getNumPrograms() override                                { return 1; }
+    int getCurrentProgram() override                             { return 0; }
+    void setCurrentProgram (int) override                        {}
+    const juce::String getProgramName (int) override             { return {}; }
+    void changeProgramName (int, const juce::String&) override   {}
+
+    //==============================================================================
+    void getStateInformation (juce::MemoryBlock&) override       {}
+    void setStateInformation (const void*, int) override         {}
+
+private:
+    //==============================================================================
+    class Watchdog;
+
+    bool startWorker();
+    void stopWorker();
+    bool restartWorker();
+    bool sendCommand (int command);
+    bool runCommand (int command);
+
+    //==============================================================================
+    SandboxConfig config;
+    std::unique_ptr<SandboxSharedRegion> shared;
+    juce::ChildProcess worker;
+    juce::CriticalSection workerLock;       // worker and shared, against the watchdog
+    std::unique_ptr<Watchdog> watchdog;
+
+    uint32 nextSequence = 0;
+    std::atomic<uint32> pendingSequence { 0 };
+    std::atomic<uint32> expiredSequence { 0 };
+    std::atomic<int64> pendingDeadline { 0 };
+
+    int numRestarts = 0;
+    int numDroppedBlocks = 0;
+    int64 lastBlockCpuNanoseconds = 0;     // worker thread CPU time of the last processBlock
+    bool failed = false;
+    //==============================================================================
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (SandboxedProcessor)
+};
+
+
+// Both return nullptr if the worker cannot load the plugin.
+std::unique_ptr<SandboxedProcessor> loadSandboxedPlugin(
+        String pathToPlugin,
+        int sampleRate,
+        int bufferSize,
+        int inChannel,
+        int outChannel,
+        bool isInstrument=false,
+        String stateString="");
+std::unique_ptr<SandboxedProcessor> loadSandboxedGraph(
+    String pathToGraph,
+    int sampleRate,
+    int bufferSize);
+
+// worker side, returns the process exit code
+bool isSandboxWorker(int argc, char* argv[]);
+int runSandboxWorker(int argc, char* argv[]);
+
+} // namespace MusicIO
+
+
+#endif /* PluginSandbox_hpp */
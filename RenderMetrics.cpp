@@ -0,0 +1,354 @@
+//
+//  RenderMetrics.cpp
+//  console_renderer - ConsoleApp
+//
+//  Render progress, throughput and resource telemetry.
+//
+
+#include "RenderMetrics.hpp"
+
+#if JUCE_MAC || JUCE_LINUX
+ #include <sys/resource.h>
+ #include <time.h>
+#endif
+
+#include <algorithm>
+#include <map>
+
+
+using namespace juce;
+
+namespace
+{
+    String escapeLabel (const String& value)
+    {
+        return value.replace ("\\", "\\\\").replace ("\"", "\\\"").replace ("\n", "\\n");
+    }
+
+    String metricLine (const String& name, const String& labels, double value)
+    {
+        return name + (labels.isEmpty() ? String() : "{" + labels + "}") + " " + String (value, 6) + "\n";
+    }
+}
+
+//==============================================================================
+// Job
+
+MusicIO::JobMetrics::JobMetrics(String name, String plugin, int rate)
+    : jobName (name), pluginName (plugin), sampleRate (rate)
+{
+}
+
+void MusicIO::JobMetrics::start(int64 numSamples)
+{
+    totalSamples.store (numSamples, std::memory_order_relaxed);
+    startTicks.store (Time::getHighResolutionTicks(), std::memory_order_relaxed);
+    state.store (running, std::memory_order_release);
+}
+
+void MusicIO::JobMetrics::addBlock(int numSamples, int64 cpuTime, int numDroppedBlocks, int numRestarts)
+{
+    blocksProcessed.fetch_add (1, std::memory_order_relaxed);
+    samplesProcessed.fetch_add (numSamples, std::memory_order_relaxed);
+    cpuNanoseconds.fetch_add (cpuTime, std::memory_order_relaxed);
+
+    if (numDroppedBlocks > 0)
+        droppedBlocks.fetch_add (numDroppedBlocks, std::memory_order_relaxed);
+    if (numRestarts > 0)
+        workerRestarts.fetch_add (numRestarts, std::memory_order_relaxed);
+}
+
+void MusicIO::JobMetrics::finish()
+{
+    endTicks.store (Time::getHighResolutionTicks(), std::memory_order_relaxed);
+    state.store (finished, std::memory_order_release);
+}
+
+double MusicIO::JobMetrics::getProgress() const
+{
+    auto total = totalSamples.load (std::memory_order_relaxed);
+    return total > 0 ? (double) samplesProcessed.load (std::memory_order_relaxed) / (double) total : 0.0;
+}
+
+double MusicIO::JobMetrics::getWallSeconds() const
+{
+    auto currentState = state.load (std::memory_order_acquire);
+    if (currentState == queued)
+        return 0.0;
+
+    auto end = currentState == finished ? endTicks.load (std::memory_order_relaxed)
+                                        : Time::getHighResolutionTicks();
+    return Time::highResolutionTicksToSeconds (end - startTicks.load (std::memory_order_relaxed));
+}
+
+double MusicIO::JobMetrics::getRealtimeFactor() const
+{
+    auto wall = getWallSeconds();
+    if (wall <= 0.0 || sampleRate <= 0)
+        return 0.0;
+
+    return (double) samplesProcessed.load (std::memory_order_relaxed) / sampleRate / wall;
+}
+
+//==============================================================================
+// Registry
+
+MusicIO::RenderMetrics& MusicIO::RenderMetrics::getInstance()
+{
+    static RenderMetrics metrics;
+    return metrics;
+}
+
+std::shared_ptr<MusicIO::JobMetrics> MusicIO::RenderMetrics::createJob(String jobName, String pluginName, int sampleRate)
+{
+    auto job = std::make_shared<JobMetrics> (jobName, pluginName, sampleRate);
+    std::lock_guard<std::mutex> guard (lock);
+    jobs.push_back (job);
+    return job;
+}
+
+void MusicIO::RenderMetrics::removeFinishedJobs()
+{
+    std::lock_guard<std::mutex> guard (lock);
+    jobs.erase (std::remove_if (jobs.begin(), jobs.end(),
+                                [] (const std::shared_ptr<JobMetrics>& job)
+                                {
+                                    return job->state.load() == JobMetrics::finished;
+                                }),
+                jobs.end());
+}
+
+std::vector<std::shared_ptr<MusicIO::JobMetrics>> MusicIO::RenderMetrics::getJobs() const
+{
+    std::lock_guard<std::mutex> guard (lock);
+    return jobs;
+}
+
+int64 MusicIO::RenderMetrics::getThreadCpuNanoseconds()
+{
+   #if JUCE_MAC || JUCE_LINUX
+    timespec ts;
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64) ts.tv_sec * 1000000000 + (int64) ts.tv_nsec;
+   #else
+    // wall clock where thread CPU time is not available
+    return (int64) (Time::highResolutionTicksToSeconds (Time::getHighResolutionTicks()) * 1.0e9);
+   #endif
+}
+
+int64 MusicIO::RenderMetrics::getPeakMemoryBytes()
+{
+   #if JUCE_MAC || JUCE_LINUX
+    rusage usage;
+    if (getrusage (RUSAGE_SELF, &usage) != 0)
+        return 0;
+   #if JUCE_MAC
+    return (int64) usage.ru_maxrss;            // bytes
+   #else
+    return (int64) usage.ru_maxrss * 1024;     // kilobytes
+   #endif
+   #else
+    return 0;
+   #endif
+}
+
+//==============================================================================
+// Export
+
+String MusicIO::RenderMetrics::toPrometheusText() const
+{
+    auto snapshot = getJobs();
+    String text;
+
+    int numQueued = 0;
+    int numRunning = 0;
+    std::map<String, double> pluginCpuSeconds;
+
+    text << "# TYPE musicio_job_blocks_processed_total counter\n";
+    for (auto& job : snapshot)
+    {
+        auto labels = "job=\"" + escapeLabel (job->jobName) + "\",plugin=\"" + escapeLabel (job->pluginName) + "\"";
+        text << metricLine ("musicio_job_blocks_processed_total", labels, (double) job->blocksProcessed.load());
+    }
+
+    text << "# TYPE musicio_job_dropped_blocks_total counter\n";
+    for (auto& job : snapshot)
+    {
+        auto labels = "job=\"" + escapeLabel (job->jobName) + "\",plugin=\"" + escapeLabel (job->pluginName) + "\"";
+        text << metricLine ("musicio_job_dropped_blocks_total", labels, (double) job->droppedBlocks.load());
+    }
+
+    text << "# TYPE musicio_job_worker_restarts_total counter\n";
+    for (auto& job : snapshot)
+    {
+        auto labels = "job=\"" + escapeLabel (job->jobName) + "\",plugin=\"" + escapeLabel (job->pluginName) + "\"";
+        text << metricLine ("musicio_job_worker_restarts_total", labels, (double) job->workerRestarts.load());
+    }
+
+    text << "# TYPE musicio_job_progress gauge\n";
+    for (auto& job : snapshot)
+    {
+        auto labels = "job=\"" + escapeLabel (job->jobName) + "\",plugin=\"" + escapeLabel (job->pluginName) + "\"";
+        text << metricLine ("musicio_job_progress", labels, job->getProgress());
+    }
+
+    text << "# TYPE musicio_job_realtime_factor gauge\n";
+    for (auto& job : snapshot)
+    {
+        auto labels = "job=\"" + escapeLabel (job->jobName) + "\",plugin=\"" + escapeLabel (job->pluginName) + "\"";
+        text << metricLine ("musicio_job_realtime_factor", labels, job->getRealtimeFactor());
+    }
+
+    text << "# TYPE musicio_job_cpu_seconds_total counter\n";
+    for (auto& job : snapshot)
+    {
+        auto labels = "job=\"" + escapeLabel (job->jobName) + "\",plugin=\"" + escapeLabel (job->pluginName) + "\"";
+        auto cpuSeconds = (double) job->cpuNanoseconds.load() * 1.0e-9;
+        text << metricLine ("musicio_job_cpu_seconds_total", labels, cpuSeconds);
+
+        pluginCpuSeconds[job->pluginName] += cpuSeconds;
+        auto state = job->state.load();
+        numQueued  += state == JobMetrics::queued  ? 1 : 0;
+        numRunning += state == JobMetrics::running ? 1 : 0;
+    }
+
+    text << "# TYPE musicio_plugin_cpu_seconds_total counter\n";
+    for (auto& plugin : pluginCpuSeconds)
+        text << metricLine ("musicio_plugin_cpu_seconds_total", "plugin=\"" + escapeLabel (plugin.first) + "\"", plugin.second);
+
+    text << "# TYPE musicio_jobs_queued gauge\n"
+         << metricLine ("musicio_jobs_queued", {}, numQueued)
+         << "# TYPE musicio_jobs_running gauge\n"
+         << metricLine ("musicio_jobs_running", {}, numRunning)
+         << "# TYPE musicio_files_read_total counter\n"
+         << metricLine ("musicio_files_read_total", {}, (double) filesRead.load())
+         << "# TYPE musicio_files_written_total counter\n"
+         << metricLine ("musicio_files_written_total", {}, (double) filesWritten.load())
+         << "# TYPE musicio_bytes_read_total counter\n"
+         << metricLine ("musicio_bytes_read_total", {}, (double) bytesRead.load())
+         << "# TYPE musicio_bytes_written_total counter\n"
+         << metricLine ("musicio_bytes_written_total", {}, (double) bytesWritten.load())
+         << "# TYPE musicio_peak_memory_bytes gauge\n"
+         << metricLine ("musicio_peak_memory_bytes", {}, (double) getPeakMemoryBytes());
+
+    return text;
+}
+
+String MusicIO::RenderMetrics::toJson() const
+{
+    auto snapshot = getJobs();
+    Array<var> jobList;
+    int numQueued = 0;
+    int numRunning = 0;
+    std::map<String, double> pluginCpuSeconds;
+
+    for (auto& job : snapshot)
+    {
+        auto state = job->state.load();
+        numQueued  += state == JobMetrics::queued  ? 1 : 0;
+        numRunning += state == JobMetrics::running ? 1 : 0;
+
+        DynamicObject::Ptr entry (new DynamicObject());
+        entry->setProperty ("job", job->jobName);
+        entry->setProperty ("plugin", job->pluginName);
+        entry->setProperty ("state", state == JobMetrics::queued ? "queued" : state == JobMetrics::running ? "running" : "finished");
+        entry->setProperty ("blocksProcessed", job->blocksProcessed.load());
+        entry->setProperty ("droppedBlocks", job->droppedBlocks.load());
+        entry->setProperty ("workerRestarts", job->workerRestarts.load());
+        entry->setProperty ("samplesProcessed", job->samplesProcessed.load());
+        entry->setProperty ("totalSamples", job->totalSamples.load());
+        entry->setProperty ("progress", job->getProgress());
+        entry->setProperty ("realtimeFactor", job->getRealtimeFactor());
+        auto cpuSeconds = (double) job->cpuNanoseconds.load() * 1.0e-9;
+        entry->setProperty ("cpuSeconds", cpuSeconds);
+        entry->setProperty ("wallSeconds", job->getWallSeconds());
+        jobList.add (var (entry.get()));
+
+        pluginCpuSeconds[job->pluginName] += cpuSeconds;
+    }
+
+    Array<var> pluginList;
+    for (auto& plugin : pluginCpuSeconds)
+    {
+        DynamicObject::Ptr entry (new DynamicObject());
+        entry->setProperty ("plugin", plugin.first);
+        entry->setProperty ("cpuSeconds", plugin.second);
+        pluginList.add (var (entry.get()));
+    }
+
+    DynamicObject::Ptr root (new DynamicObject());
+    root->setProperty ("jobs", jobList);
+    root->setProperty ("plugins", pluginList);
+    root->setProperty ("jobsQueued", numQueued);
+    root->setProperty ("jobsRunning", numRunning);
+    root->setProperty ("filesRead", filesRead.load());
+    root->setProperty ("filesWritten", filesWritten.load());
+    root->setProperty ("bytesRead", bytesRead.load());
+    root->setProperty ("bytesWritten", bytesWritten.load());
+    root->setProperty ("peakMemoryBytes", getPeakMemoryBytes());
+
+    return JSON::toString (var (root.get()));
+}
+
+bool MusicIO::RenderMetrics::writePrometheusFile(File file) const
+{
+    // written next to the target and moved over it, so scrapers never see a partial file
+    TemporaryFile temp (file);
+    return temp.getFile().replaceWithText (toPrometheusText()) && temp.overwriteTargetFileWithTemporary();
+}
+
+bool MusicIO::RenderMetrics::writeJsonFile(File file) const
+{
+    TemporaryFile temp (file);
+    return temp.getFile().replaceWithText (toJson()) && temp.overwriteTargetFileWithTemporary();
+}
+
+//==============================================================================
+// Poller
+
+MusicIO::MetricsPoller::MetricsPoller(int interval, std::function<void (const RenderMetrics&)> metricsCallback)
+    : Thread ("MetricsPoller"), intervalMs (interval), callback (std::move (metricsCallback))
+{
+    startThread();
+}
+
+MusicIO::MetricsPoller::MetricsPoller(int interval, File file, Format exportFormat)
+    : Thread ("MetricsPoller"), intervalMs (interval), exportFile (file), format (exportFormat)
+{
+    startThread();
+}
+
+MusicIO::MetricsPoller::~MetricsPoller()
+{
+    signalThreadShouldExit();
+    notify();
+    stopThread (intervalMs + 1000);
+
+    // final sample, so short jobs are always reported
+    poll();
+}
+
+void MusicIO::MetricsPoller::run()
+{
+    while (! threadShouldExit())
+    {
+        poll();
+        wait (intervalMs);
+    }
+}
+
+void MusicIO::MetricsPoller::poll()
+{
+    auto& metrics = RenderMetrics::getInstance();
+
+    if (callback)
+        callback (metrics);
+
+    if (exportFile != File())
+    {
+        if (format == prometheus)
+            metrics.writePrometheusFile (exportFile);
+        else
+            metrics.writeJsonFile (exportFile);
+    }
+}
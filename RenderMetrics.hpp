@@ -0,0 +1,111 @@
+//
+//  RenderMetrics.hpp
+//  console_renderer - ConsoleApp
+//
+//  Render progress, throughput and resource telemetry.
+//
+
+#ifndef RenderMetrics_hpp
+#define RenderMetrics_hpp
+
+#include <JuceHeader.h>
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+using namespace juce;
+
+
+namespace MusicIO {
+
+/*
+ Counters of one render job. The render thread only does relaxed atomic
+ updates; reading, formatting and writing happen on whichever thread samples
+ them (see MetricsPoller), never on the processing thread.
+ */
+
+struct JobMetrics{
+    enum State { queued = 0, running, finished };
+
+    JobMetrics(String jobName, String pluginName, int sampleRate);
+
+    void start(int64 numSamples);
+    void addBlock(int numSamples, int64 cpuNanoseconds, int numDroppedBlocks=0, int numRestarts=0);
+    void finish();
+
+    double getProgress() const;
+    double getWallSeconds() const;
+    double getRealtimeFactor() const;   // seconds of audio rendered per second
+
+    const String jobName;
+    const String pluginName;
+    const int sampleRate;
+
+    std::atomic<int> state { queued };
+    std::atomic<int64> blocksProcessed { 0 };
+    std::atomic<int64> samplesProcessed { 0 };
+    std::atomic<int64> totalSamples { 0 };
+    std::atomic<int64> cpuNanoseconds { 0 };    // thread CPU time inside processBlock
+    std::atomic<int64> droppedBlocks { 0 };     // rendered as silence by a failed sandbox worker
+    std::atomic<int64> workerRestarts { 0 };
+    std::atomic<int64> startTicks { 0 };
+    std::atomic<int64> endTicks { 0 };
+};
+
+
+class RenderMetrics
+{
+public:
+    static RenderMetrics& getInstance();
+
+    std::shared_ptr<JobMetrics> createJob(String jobName, String pluginName, int sampleRate);
+    void removeFinishedJobs();
+    std::vector<std::shared_ptr<JobMetrics>> getJobs() const;
+
+    String toPrometheusText() const;
+    String toJson() const;
+    bool writePrometheusFile(File file) const;
+    bool writeJsonFile(File file) const;
+
+    static int64 getThreadCpuNanoseconds();
+    static int64 getPeakMemoryBytes();
+
+    // file IO
+    std::atomic<int64> filesRead { 0 };
+    std::atomic<int64> filesWritten { 0 };
+    std::atomic<int64> bytesRead { 0 };
+    std::atomic<int64> bytesWritten { 0 };
+
+private:
+    mutable std::mutex lock;    // guards the job list, not the counters
+    std::vector<std::shared_ptr<JobMetrics>> jobs;
+};
+
+
+// Samples RenderMetrics on its own thread every intervalMs.
+class MetricsPoller : private juce::Thread
+{
+public:
+    enum Format { prometheus, json };
+
+    MetricsPoller(int intervalMs, std::function<void (const RenderMetrics&)> callback);
+    MetricsPoller(int intervalMs, File exportFile, Format format);
+    ~MetricsPoller() override;
+
+private:
+    void run() override;
+    void poll();
+
+    int intervalMs;
+    std::function<void (const RenderMetrics&)> callback;
+    File exportFile;
+    Format format = json;
+    //==============================================================================
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (MetricsPoller)
+};
+
+} // namespace MusicIO
+
+
+#endif /* RenderMetrics_hpp */